@@ -6,6 +6,19 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#ifndef ECS_NO_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#endif
+#ifndef ECS_NO_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 
 #ifndef ECS_DA_INIT_CAP
@@ -14,9 +27,32 @@
 #ifndef ECS_REALLOC
 #define ECS_REALLOC realloc
 #endif
+#ifndef ECS_FREE
+#define ECS_FREE free
+#endif
 #ifndef ECS_ASSERT
 #define ECS_ASSERT assert
 #endif
+// Masks are ECS_MAX_COMPONENTS bits rounded up to whole 64-bit words
+#ifndef ECS_MAX_COMPONENTS
+#define ECS_MAX_COMPONENTS 64
+#endif
+#define ECS_MASK_WORDS ((ECS_MAX_COMPONENTS + 63) / 64)
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define ECS_MASK_SIMD_WORDS 4
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define ECS_MASK_SIMD_WORDS 2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define ECS_MASK_SIMD_WORDS 2
+#else
+#define ECS_MASK_SIMD_WORDS 1
+#endif
+
+#define ecs_align_up(n, align) (((n) + (align) - 1) & ~(size_t)((align) - 1))
 
 #define ecs_da_reserve(da, expected_capacity)                                              \
     do {                                                                                   \
@@ -39,6 +75,43 @@
     } while (0)
 
 
+// Same as above but the memory comes from an ECSAllocator, NULL means ECS_REALLOC/ECS_FREE
+#define ecs_da_reserve_with(allocator, da, expected_capacity)                              \
+    do {                                                                                   \
+        if ((expected_capacity) > (da)->capacity) {                                        \
+            size_t ecs_old_capacity = (da)->capacity;                                      \
+            if ((da)->capacity == 0) {                                                     \
+                (da)->capacity = ECS_DA_INIT_CAP;                                          \
+            }                                                                              \
+            while ((expected_capacity) > (da)->capacity) {                                 \
+                (da)->capacity *= 2;                                                       \
+            }                                                                              \
+            (da)->items = ecs_mem_realloc((allocator), (da)->items,                        \
+                                          ecs_old_capacity * sizeof(*(da)->items),         \
+                                          (da)->capacity * sizeof(*(da)->items));          \
+            ECS_ASSERT((da)->items != NULL && "Buy more RAM lol");                         \
+        }                                                                                  \
+    } while (0)
+
+#define ecs_da_append_with(allocator, da, item)                \
+    do {                                                       \
+        ecs_da_reserve_with((allocator), (da), (da)->count + 1); \
+        (da)->items[(da)->count++] = (item);                   \
+    } while (0)
+
+#define ecs_da_free_with(allocator, da) ecs_mem_free((allocator), (da)->items, (da)->capacity * sizeof(*(da)->items))
+
+// Drops the capacity past `count`, an empty array gives all of its memory back
+#define ecs_da_shrink_with(allocator, da)                                                    \
+    do {                                                                                     \
+        (da)->items = ecs_mem_shrink((allocator), (da)->items,                               \
+                                     (da)->capacity * sizeof(*(da)->items),                  \
+                                     (da)->count * sizeof(*(da)->items));                    \
+        (da)->capacity = (da)->count;                                                        \
+    } while (0)
+
+#define ecs_da_bytes(da) ((da)->capacity * sizeof(*(da)->items))
+
 #define ecs_da_last(da) (da)->items[(ECS_ASSERT((da)->count > 0), (da)->count-1)]
 #define ecs_da_remove_unordered(da, i)               \
     do {                                             \
@@ -50,40 +123,221 @@
 
 #define ecs_da_foreach(Type, it, da) for (Type *it = (da)->items; it < (da)->items + (da)->count; ++it)
 
+// ----------------------
+// Allocators
+// ----------------------
+// Every allocation the registry makes goes through an ECSAllocator. `old_size`/`size` are
+// passed back on realloc and free so arenas and pools don't need headers. The registry only
+// keeps a pointer, the ECSAllocator itself has to outlive it.
+typedef struct {
+    void* (*alloc)(void *ctx, size_t size);
+    void* (*realloc)(void *ctx, void *ptr, size_t old_size, size_t new_size);
+    void (*free)(void *ctx, void *ptr, size_t size);
+    void *ctx;
+} ECSAllocator;
+
+// Bump allocator for scratch memory: allocations are never freed one by one,
+// ecs_arena_reset() drops all of them at once and keeps the blocks for the next frame
+#ifndef ECS_ARENA_ALIGN
+#define ECS_ARENA_ALIGN 16
+#endif
+
+typedef struct ECSArenaBlock ECSArenaBlock;
+struct ECSArenaBlock {
+    ECSArenaBlock *next;
+    size_t capacity, used;
+};
+
+typedef struct {
+    ECSArenaBlock *first, *current;
+    size_t block_size;
+    void *last; // the most recent allocation can grow in place
+    const ECSAllocator *parent;
+} ECSArena;
+
+// Fixed-size block allocator, blocks are carved out of slabs taken from `parent` and recycled
+// through a free list. Requests bigger than `block_size` go straight to `parent`.
+typedef struct {
+    void **items;
+    size_t capacity, count;
+} ECSPoolSlabs;
+
+typedef struct {
+    size_t block_size, blocks_per_slab;
+    void *free_list;
+    ECSPoolSlabs slabs;
+    const ECSAllocator *parent;
+} ECSPool;
+
 #define Component(name, ...) \
-    static size_t COMP_##name; \
+    static size_t COMP_##name = ECS_NO_COMPONENT; \
     typedef __VA_ARGS__ name; \
-    typedef struct {size_t capacity, count; name * items;} ECS_DA_##name;\
-    static ECS_DA_##name name##_components; \
-    void cleanup_##name() { \
-        free(name##_components.items); \
+    void register_##name() { \
+        if(COMP_##name != ECS_NO_COMPONENT) return; \
+        COMP_##name = ecs_register_component(#name, sizeof(name)); \
     }\
+    name* get_##name(ECSWorld *w, ECSEntity* e) { return ecs_component_get(w, e, COMP_##name); } \
+    name* get_mut_##name(ECSWorld *w, ECSEntity* e) { return ecs_component_get_mut(w, e, COMP_##name); } \
+    void set_##name(ECSWorld *w, ECSEntity* e, name value) { \
+        if(COMP_##name == ECS_NO_COMPONENT) { printf("[ERROR] Forgot to register `%s` component first\n", #name); abort(); }\
+        ecs_component_set(w, e, COMP_##name, &value); \
+    } \
+    void add_##name(ECSWorld *w, ECSEntity* e, name value) { \
+        if(COMP_##name == ECS_NO_COMPONENT) { printf("[ERROR] Forgot to register `%s` component first\n", #name); abort(); }\
+        ecs_component_add(w, e, COMP_##name, &value); \
+    } \
+    void add_##name##_bulk(ECSWorld *w, const ECSEntityId* ids, const name* values, size_t count) { \
+        if(COMP_##name == ECS_NO_COMPONENT) { printf("[ERROR] Forgot to register `%s` component first\n", #name); abort(); }\
+        ecs_component_add_bulk(w, COMP_##name, ids, values, count); \
+    } \
+    void remove_##name(ECSWorld *w, ECSEntity* e) { \
+        if(COMP_##name == ECS_NO_COMPONENT) { printf("[ERROR] Forgot to register `%s` component first\n", #name); abort(); }\
+        ecs_component_remove(w, e, COMP_##name); \
+    } \
+    void cmd_add_##name(ECSCommandBuffer *cb, ECSEntityId id, name value) { \
+        if(COMP_##name == ECS_NO_COMPONENT) { printf("[ERROR] Forgot to register `%s` component first\n", #name); abort(); }\
+        ecs_cmd_add(cb, id, COMP_##name, &value); \
+    } \
+    void cmd_remove_##name(ECSCommandBuffer *cb, ECSEntityId id) { \
+        ecs_cmd_remove(cb, id, COMP_##name); \
+    } \
+    ECS_COMPONENT_STORAGE_FUNCS(name)
+
+// A component without data, `Component(name, struct {})` registers as a tag too
+#define Tag(name) \
+    static size_t COMP_##name = ECS_NO_COMPONENT; \
+    void register_##name() { \
+        if(COMP_##name != ECS_NO_COMPONENT) return; \
+        COMP_##name = ecs_register_component(#name, 0); \
+    }\
+    bool has_##name(ECSEntity* e) { \
+        if(COMP_##name == ECS_NO_COMPONENT) { printf("[ERROR] Forgot to register `%s` component first\n", #name); abort(); }\
+        return ecs_mask_test(&e->mask, COMP_##name); \
+    } \
+    void add_##name(ECSWorld *w, ECSEntity* e) { \
+        if(COMP_##name == ECS_NO_COMPONENT) { printf("[ERROR] Forgot to register `%s` component first\n", #name); abort(); }\
+        ecs_component_add(w, e, COMP_##name, NULL); \
+    } \
+    void add_##name##_bulk(ECSWorld *w, const ECSEntityId* ids, size_t count) { \
+        if(COMP_##name == ECS_NO_COMPONENT) { printf("[ERROR] Forgot to register `%s` component first\n", #name); abort(); }\
+        ecs_component_add_bulk(w, COMP_##name, ids, NULL, count); \
+    } \
+    void remove_##name(ECSWorld *w, ECSEntity* e) { \
+        if(COMP_##name == ECS_NO_COMPONENT) { printf("[ERROR] Forgot to register `%s` component first\n", #name); abort(); }\
+        ecs_component_remove(w, e, COMP_##name); \
+    } \
+    void cmd_add_##name(ECSCommandBuffer *cb, ECSEntityId id) { \
+        if(COMP_##name == ECS_NO_COMPONENT) { printf("[ERROR] Forgot to register `%s` component first\n", #name); abort(); }\
+        ecs_cmd_add(cb, id, COMP_##name, NULL); \
+    } \
+    void cmd_remove_##name(ECSCommandBuffer *cb, ECSEntityId id) { \
+        ecs_cmd_remove(cb, id, COMP_##name); \
+    }
+
+// A single value owned by the world, see ecs_resource_get()
+#define Resource(name, ...) \
+    static size_t COMP_##name = ECS_NO_COMPONENT; \
+    typedef __VA_ARGS__ name; \
     void register_##name() { \
-        if(COMP_##name == 0) COMP_##name = 1 << ecs_component_type_iota(); \
-        ecs_da_append(&ecs_components_cleanups, cleanup_##name);\
+        if(COMP_##name != ECS_NO_COMPONENT) return; \
+        COMP_##name = ecs_register_resource(#name, sizeof(name)); \
     }\
-    name* get_##name(ECSEntity* e) { return &name##_components.items[e->id]; } \
-    void add_##name(ECSEntity* e, name value) { \
-        if(COMP_##name == 0) { printf("[ERROR] Forgot to register `%s` componet first\n", #name); abort(); }\
-        e->mask |= COMP_##name; \
-        ecs_da_append(&(name##_components), value); \
+    name* get_##name(ECSWorld *w) { return ecs_resource_get(w, COMP_##name); } \
+    name* set_##name(ECSWorld *w, name value) { \
+        if(COMP_##name == ECS_NO_COMPONENT) { printf("[ERROR] Forgot to register `%s` resource first\n", #name); abort(); }\
+        return ecs_resource_set(w, COMP_##name, &value); \
+    } \
+    void remove_##name(ECSWorld *w) { \
+        ecs_resource_remove(w, COMP_##name); \
     }
 
-#define System(name, ...) void name##_system(__VA_ARGS__)
-#define QueryByComponents(e, ...) \
-    ecs_da_foreach(ECSEntity, e, &ecs_entities) if(ecs_has_components(e, __VA_ARGS__))
-#define QueryById(e, _id) \
-    ecs_da_foreach(ECSEntity, e, &ecs_entities) if(e->id == _id)
+// Systems get the world they run on as `world`, extra parameters come after it.
+// With ECS_PROFILE the ones without extra parameters are timed, see Profiling below.
+#define System(name, ...) \
+    ECS_SYSTEM_PICK(_, ##__VA_ARGS__, ECS_SYSTEM_PLAIN, ECS_SYSTEM_PLAIN, ECS_SYSTEM_PLAIN, ECS_SYSTEM_PLAIN, \
+                    ECS_SYSTEM_PLAIN, ECS_SYSTEM_PLAIN, ECS_SYSTEM_PLAIN, ECS_SYSTEM_PLAIN, ECS_SYSTEM_PROFILED)(name, ##__VA_ARGS__)
+#define ECS_SYSTEM_PICK(_0, _1, _2, _3, _4, _5, _6, _7, _8, macro, ...) macro
+#define ECS_SYSTEM_PLAIN(name, ...) void name##_system(ECSWorld *world, __VA_ARGS__)
+// Builds an ECSEntityMask out of component ids: `ecs_mask(COMP_Position, COMP_Velocity)`
+#define ecs_mask(...) ecs_mask_of((size_t[]){__VA_ARGS__}, sizeof((size_t[]){__VA_ARGS__}) / sizeof(size_t))
+#define QueryByComponents(w, e, ...) QueryByComponentMask(w, e, ecs_mask(__VA_ARGS__))
+#define QueryById(w, e, _id) \
+    for (ECSEntity *e = ecs_get_entity_with_id(w, _id); e != NULL; e = NULL)
+// Like QueryByComponents, `Changed(name)` and `Added(name)` terms only let through entities whose
+// value was written (get_mut_, set_, add_) or added at tick `since` or later:
+// `QueryFiltered(w, e, last_sync, COMP_Position, Changed(Velocity))`
+#define QueryFiltered(w, e, since, ...) \
+    for (ECSFilterIter e##_it = ecs_filter_iter(w, ecs_filter_of((size_t[]){__VA_ARGS__}, sizeof((size_t[]){__VA_ARGS__}) / sizeof(size_t), (since))); \
+         e##_it.keep && ecs_filter_iter_next(&e##_it); e##_it.keep = !e##_it.keep) \
+        for (ECSEntity *e __attribute__((unused)) = e##_it.entity; e##_it.keep; e##_it.keep = !e##_it.keep)
+#define ECS_TERM_CHANGED ((size_t)1 << (sizeof(size_t) * 8 - 2))
+#define ECS_TERM_ADDED ((size_t)1 << (sizeof(size_t) * 8 - 3))
+#define Changed(name) (COMP_##name | ECS_TERM_CHANGED)
+#define Added(name) (COMP_##name | ECS_TERM_ADDED)
+
+#ifdef ECS_ARCHETYPES
+// `break` inside the body stops the whole query: the inner loop leaves `keep` set and the outer one bails out
+#define QueryByComponentMask(w, e, mask) \
+    for (ECSEntityIter e##_it = ecs_entity_iter(w, mask); e##_it.keep && ecs_entity_iter_next(&e##_it); e##_it.keep = !e##_it.keep) \
+        for (ECSEntity *e __attribute__((unused)) = e##_it.entity; e##_it.keep; e##_it.keep = !e##_it.keep)
+// Visits every chunk of every archetype that matches, columns are fetched with `ecs_column(&it, name)`
+#define QueryChunks(w, it, ...) \
+    for (ECSChunkIter it = ecs_chunk_iter(w, ecs_mask(__VA_ARGS__)); ecs_chunk_iter_next(&it);)
+#define ecs_column(it, name) ((name*)ecs_chunk_column((it), COMP_##name))
+// Same as above but only walks the archetypes an ECSQuery already matched
+#define QueryCached(e, query) \
+    for (ECSEntityIter e##_it = ecs_query_entity_iter(query); e##_it.keep && ecs_entity_iter_next(&e##_it); e##_it.keep = !e##_it.keep) \
+        for (ECSEntity *e __attribute__((unused)) = e##_it.entity; e##_it.keep; e##_it.keep = !e##_it.keep)
+#define QueryCachedChunks(it, query) \
+    for (ECSChunkIter it = ecs_query_chunk_iter(query); ecs_chunk_iter_next(&it);)
+#define ECS_COMPONENT_STORAGE_FUNCS(name)
+#else
+// Scans `ecs_entities` in batches of ECS_SCAN_BATCH, the masks of a batch are tested with SIMD
+// and the loop body only runs over the compacted list of matches
+#define QueryByComponentMask(w, e, mask) \
+    for (ECSScanIter e##_it = ecs_scan_iter(w, mask); e##_it.keep && ecs_scan_iter_next(&e##_it); e##_it.keep = !e##_it.keep) \
+        for (ECSEntity *e __attribute__((unused)) = e##_it.entity; e##_it.keep; e##_it.keep = !e##_it.keep)
+// Iterates the packed values of a single component, use `entity_of_<name>(it)` to get the owner
+#define QueryComponent(w, it, name) \
+    for (name *it = (name*)ecs_world_storage(w, COMP_##name)->data, \
+              *it##_end = it + ecs_world_storage(w, COMP_##name)->dense.count; it < it##_end; ++it)
+// Walks the match list of an ECSQuery from the back, so despawning or removing a component
+// from the current entity is fine, entities that start matching mid-loop are not visited
+#define QueryCached(e, query) \
+    for (ECSQueryIter e##_it = ecs_query_iter(query); e##_it.keep && ecs_query_iter_next(&e##_it); e##_it.keep = !e##_it.keep) \
+        for (ECSEntity *e __attribute__((unused)) = e##_it.entity; e##_it.keep; e##_it.keep = !e##_it.keep)
+#define ECS_COMPONENT_STORAGE_FUNCS(name) \
+    ECSEntityId entity_of_##name(ECSWorld *w, name* it) { return ecs_sparse_entity_of(ecs_world_storage(w, COMP_##name), it); }
+#endif // ECS_ARCHETYPES
 
 // ----------------------
 // ECS "registry"
 // ----------------------
-typedef unsigned long int ECSEntityMask;
-typedef size_t ECSEntityId;
+typedef struct ECSWorld ECSWorld;
+typedef struct ECSThreadPool ECSThreadPool;
+
+typedef struct {
+    uint64_t words[ECS_MASK_WORDS];
+} ECSEntityMask;
+// Entity handles pack the slot index in the low 32 bits and the slot generation in the next 31.
+// Despawning bumps the generation, so handles to a recycled slot stop resolving instead of
+// aliasing the new entity. A dead slot keeps ECS_ENTITY_DEAD set in its id so no handle matches it.
+typedef uint64_t ECSEntityId;
+
+#define ECS_ENTITY_DEAD ((ECSEntityId)1 << 63)
+#define ECS_ENTITY_INDEX_MASK 0xFFFFFFFFull
+#define ecs_entity_index(id) ((size_t)((id) & ECS_ENTITY_INDEX_MASK))
+#define ecs_entity_generation(id) ((uint32_t)(((id) & ~ECS_ENTITY_DEAD) >> 32))
+#define ecs_entity_make_id(index, generation) ((ECSEntityId)(index) | ((ECSEntityId)((generation) & 0x7FFFFFFF) << 32))
+
+#define ECS_NO_COMPONENT ((size_t)-1)
 
 typedef struct {
     ECSEntityMask mask; // bitmask dos componentes
     ECSEntityId id;
+#ifdef ECS_ARCHETYPES
+    size_t archetype, row;
+#endif
 } ECSEntity;
 
 typedef struct {
@@ -96,77 +350,4284 @@ typedef struct {
     size_t capacity, count;
 } EntityIds;
 
-typedef void (*ECSComponentsCleanupCallback)();
-typedef struct {
-    size_t capacity, count;
-    ECSComponentsCleanupCallback * items;
-} ECSComponentsCleanups;
-
-static ECSEntities ecs_entities;
-static EntityIds ecs_dead_entities;
-static ECSComponentsCleanups ecs_components_cleanups;
-
 // ----------------------
-// Helpers
+// Masks
 // ----------------------
+// These sit on the hot path of every query so they are defined here to get inlined
+// ids past the mask (ECS_NO_COMPONENT among them) are never set
+static inline bool ecs_mask_test(const ECSEntityMask *mask, size_t component) {
+    return component < ECS_MASK_WORDS * 64 && ((mask->words[component / 64] >> (component % 64)) & 1);
+}
 
-ECSEntity* ecs_spawn_entity();
-void ecs_despawn_entity(ECSEntity *e);
-void ecs_despawn_entity_with_id(ECSEntityId id);
-ECSEntity* ecs_get_entity_with_id(ECSEntityId id);
-bool ecs_has_components(ECSEntity* e, ECSEntityMask mask) ;
-size_t ecs_component_type_iota();
-void ecs_deinit();
+static inline void ecs_mask_set(ECSEntityMask *mask, size_t component) {
+    mask->words[component / 64] |= (uint64_t)1 << (component % 64);
+}
 
-// #define  ECS_IMPLEMENTATION
-#ifdef ECS_IMPLEMENTATION
+static inline void ecs_mask_clear(ECSEntityMask *mask, size_t component) {
+    mask->words[component / 64] &= ~((uint64_t)1 << (component % 64));
+}
 
-ECSEntity* ecs_spawn_entity() {
-    ECSEntityId id;
-    if(ecs_dead_entities.count > 0) {
-       id = ecs_da_last(&ecs_dead_entities);
-       ecs_dead_entities.count--;
-    } else {
-        id = ecs_entities.count;
-        ECSEntity e = {
-            .id = id,
-        };
-        ecs_da_append(&ecs_entities, e);
-    }
-    return &ecs_entities.items[id];
+static inline bool ecs_mask_equals(const ECSEntityMask *a, const ECSEntityMask *b) {
+    return memcmp(a, b, sizeof(*a)) == 0;
 }
 
-void ecs_despawn_entity(ECSEntity *e) {
-    e->mask = 0;
-    ecs_da_append(&ecs_dead_entities, e->id);
+static inline bool ecs_mask_is_empty(const ECSEntityMask *mask) {
+    uint64_t any = 0;
+    for(size_t i = 0; i < ECS_MASK_WORDS; ++i) any |= mask->words[i];
+    return any == 0;
 }
 
-void ecs_despawn_entity_with_id(ECSEntityId id) {
-    ecs_entities.items[id].id = 0;
-    ecs_da_append(&ecs_dead_entities, id);
+// Number of components in `mask` with an id lower than `component`
+static inline size_t ecs_mask_count_below(const ECSEntityMask *mask, size_t component) {
+    size_t count = 0;
+    for(size_t i = 0; i < component / 64; ++i) count += (size_t)__builtin_popcountll(mask->words[i]);
+    if(component % 64) count += (size_t)__builtin_popcountll(mask->words[component / 64] & (((uint64_t)1 << (component % 64)) - 1));
+    return count;
 }
 
-ECSEntity* ecs_get_entity_with_id(ECSEntityId id) {
-    return &ecs_entities.items[id];
+static inline size_t ecs_mask_count(const ECSEntityMask *mask) {
+    return ecs_mask_count_below(mask, ECS_MASK_WORDS * 64);
 }
 
-bool ecs_has_components(ECSEntity* e, ECSEntityMask mask) {
-    return (e->mask & mask) == mask;
+static inline ECSEntityMask ecs_mask_all() {
+    ECSEntityMask mask;
+    memset(&mask, 0xFF, sizeof(mask));
+    return mask;
 }
 
-size_t ecs_component_type_iota() {
-    static size_t id = 0;
-    return id++;
+static inline bool ecs_mask_intersects(const ECSEntityMask *a, const ECSEntityMask *b) {
+    uint64_t any = 0;
+    for(size_t i = 0; i < ECS_MASK_WORDS; ++i) any |= a->words[i] & b->words[i];
+    return any != 0;
+}
+
+// true when every component in `required` is also in `mask`. ORs `required & ~mask` over all
+// the words and tests the result once, so wide masks don't add a branch per word
+static inline bool ecs_mask_contains(const ECSEntityMask *mask, const ECSEntityMask *required) {
+    size_t i = 0;
+#if ECS_MASK_SIMD_WORDS == 4 && ECS_MASK_WORDS >= 4
+    __m256i miss = _mm256_setzero_si256();
+    for(; i + 4 <= ECS_MASK_WORDS; i += 4) {
+        __m256i m = _mm256_loadu_si256((const __m256i*)&mask->words[i]);
+        __m256i r = _mm256_loadu_si256((const __m256i*)&required->words[i]);
+        miss = _mm256_or_si256(miss, _mm256_andnot_si256(m, r));
+    }
+    if(!_mm256_testz_si256(miss, miss)) return false;
+#elif ECS_MASK_SIMD_WORDS == 2 && ECS_MASK_WORDS >= 2 && defined(__SSE2__)
+    __m128i miss = _mm_setzero_si128();
+    for(; i + 2 <= ECS_MASK_WORDS; i += 2) {
+        __m128i m = _mm_loadu_si128((const __m128i*)&mask->words[i]);
+        __m128i r = _mm_loadu_si128((const __m128i*)&required->words[i]);
+        miss = _mm_or_si128(miss, _mm_andnot_si128(m, r));
+    }
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(miss, _mm_setzero_si128())) != 0xFFFF) return false;
+#elif ECS_MASK_SIMD_WORDS == 2 && ECS_MASK_WORDS >= 2
+    uint64x2_t miss = vdupq_n_u64(0);
+    for(; i + 2 <= ECS_MASK_WORDS; i += 2) {
+        miss = vorrq_u64(miss, vbicq_u64(vld1q_u64(&required->words[i]), vld1q_u64(&mask->words[i])));
+    }
+    if(vmaxvq_u32(vreinterpretq_u32_u64(miss)) != 0) return false;
+#endif
+    uint64_t miss_tail = 0;
+    for(; i < ECS_MASK_WORDS; ++i) miss_tail |= required->words[i] & ~mask->words[i];
+    return miss_tail == 0;
+}
+
+// Writes the index of every entity in `entities[0..count)` whose mask contains `required` into `out`
+// and returns how many were written. Several entity masks are tested per instruction and the
+// matches get appended without branching.
+static inline size_t ecs_mask_filter(const ECSEntity *entities, size_t count, const ECSEntityMask *required, uint32_t *out) {
+    size_t n = 0, i = 0;
+#if ECS_MASK_SIMD_WORDS == 4
+    if(ECS_MASK_WORDS == 1 && sizeof(ECSEntity) == 16) {
+        // {mask, id} pairs: two loads cover four entities, unpacking gathers the masks as 0, 2, 1, 3
+        __m256i r = _mm256_set1_epi64x((long long)required->words[0]);
+        for(; i + 4 <= count; i += 4) {
+            __m256i lo = _mm256_loadu_si256((const __m256i*)&entities[i]);
+            __m256i hi = _mm256_loadu_si256((const __m256i*)&entities[i + 2]);
+            __m256i miss = _mm256_andnot_si256(_mm256_unpacklo_epi64(lo, hi), r);
+            unsigned bits = (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(miss, _mm256_setzero_si256())));
+            out[n] = (uint32_t)i;     n += bits & 1;
+            out[n] = (uint32_t)i + 1; n += (bits >> 2) & 1;
+            out[n] = (uint32_t)i + 2; n += (bits >> 1) & 1;
+            out[n] = (uint32_t)i + 3; n += (bits >> 3) & 1;
+        }
+    }
+    for(; i + 4 <= count; i += 4) {
+        __m256i miss = _mm256_setzero_si256();
+        for(size_t w = 0; w < ECS_MASK_WORDS; ++w) {
+            __m256i m = _mm256_set_epi64x((long long)entities[i + 3].mask.words[w], (long long)entities[i + 2].mask.words[w],
+                                          (long long)entities[i + 1].mask.words[w], (long long)entities[i].mask.words[w]);
+            miss = _mm256_or_si256(miss, _mm256_andnot_si256(m, _mm256_set1_epi64x((long long)required->words[w])));
+        }
+        unsigned bits = (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(miss, _mm256_setzero_si256())));
+        out[n] = (uint32_t)i;     n += bits & 1;
+        out[n] = (uint32_t)i + 1; n += (bits >> 1) & 1;
+        out[n] = (uint32_t)i + 2; n += (bits >> 2) & 1;
+        out[n] = (uint32_t)i + 3; n += (bits >> 3) & 1;
+    }
+#elif ECS_MASK_SIMD_WORDS == 2 && defined(__SSE2__)
+    for(; i + 2 <= count; i += 2) {
+        __m128i miss = _mm_setzero_si128();
+        for(size_t w = 0; w < ECS_MASK_WORDS; ++w) {
+            __m128i m = _mm_set_epi64x((long long)entities[i + 1].mask.words[w], (long long)entities[i].mask.words[w]);
+            miss = _mm_or_si128(miss, _mm_andnot_si128(m, _mm_set1_epi64x((long long)required->words[w])));
+        }
+        // SSE2 has no 64-bit compare, a lane is clear when both of its 32-bit halves are
+        unsigned bits = (unsigned)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(miss, _mm_setzero_si128())));
+        out[n] = (uint32_t)i;     n += (bits & 3) == 3;
+        out[n] = (uint32_t)i + 1; n += (bits >> 2) == 3;
+    }
+#elif ECS_MASK_SIMD_WORDS == 2
+    for(; i + 2 <= count; i += 2) {
+        uint64x2_t miss = vdupq_n_u64(0);
+        for(size_t w = 0; w < ECS_MASK_WORDS; ++w) {
+            uint64x2_t m = vcombine_u64(vcreate_u64(entities[i].mask.words[w]), vcreate_u64(entities[i + 1].mask.words[w]));
+            miss = vorrq_u64(miss, vbicq_u64(vdupq_n_u64(required->words[w]), m));
+        }
+        uint64x2_t hit = vceqzq_u64(miss);
+        out[n] = (uint32_t)i;     n += vgetq_lane_u64(hit, 0) & 1;
+        out[n] = (uint32_t)i + 1; n += vgetq_lane_u64(hit, 1) & 1;
+    }
+#endif
+    for(; i < count; ++i) {
+        out[n] = (uint32_t)i;
+        n += ecs_mask_contains(&entities[i].mask, required);
+    }
+    return n;
+}
+
+// ----------------------
+// Sparse set
+// ----------------------
+// Component values are packed in `data`, `dense` maps a packed index back to its entity
+// and `sparse` maps an entity index to its packed index. `sparse` is paged so it only
+// allocates for index ranges that actually own the component. Lookups compare the whole
+// handle stored in `dense`, so a stale generation never resolves.
+// Component storages also keep the added/changed tick of every value, and the newest ticks of
+// each block of ECS_TICK_BLOCK values so filtered queries can skip blocks nobody touched.
+#ifndef ECS_SPARSE_PAGE_SIZE
+#define ECS_SPARSE_PAGE_SIZE 4096
+#endif
+#define ECS_SPARSE_NONE ((size_t)-1)
+#ifndef ECS_TICK_BLOCK
+#define ECS_TICK_BLOCK 64
+#endif
+#define ECS_TICK_ADDED 0
+#define ECS_TICK_CHANGED 1
+
+typedef uint32_t ECSTicks[2]; // indexed by ECS_TICK_ADDED and ECS_TICK_CHANGED
+
+typedef struct {
+    size_t **items;
+    size_t capacity, count;
+} ECSSparsePages;
+
+typedef struct {
+    ECSSparsePages sparse;
+    EntityIds dense;
+    unsigned char *data;
+    size_t size;
+    const ECSAllocator *allocator;
+    bool borrowed;         // `data` lives in a loaded snapshot, it is copied out before growing
+    bool tracked;          // keeps `ticks` and `block_ticks`
+    ECSTicks *ticks;       // one per value
+    ECSTicks *block_ticks; // newest ticks of each ECS_TICK_BLOCK values
+    size_t initial_capacity; // first allocation in values, 0 means ECS_DA_INIT_CAP
+    float growth;            // capacity multiplier when full, 0 means 2
+} ECSSparseSet;
+
+// ----------------------
+// Archetypes
+// ----------------------
+// With ECS_ARCHETYPES defined, entities that share a mask live in the same archetype.
+// An archetype stores its rows in chunks of ECS_CHUNK_SIZE bytes, each chunk is a single block
+// holding the owning entity ids followed by one column per component, sorted by component id.
+// Rows are kept packed: only the last chunk of an archetype can be partially filled.
+// All chunks have the same size so a pool can serve them, see ecs_set_chunk_allocator(). Every
+// block is ECS_CHUNK_COLUMN_ALIGN bytes bigger than its chunk, which starts at the first aligned
+// address inside it, so columns sit on cache lines whatever alignment the allocator gives.
+// After the columns come the added/changed ticks of every cell, then the newest ticks of every
+// column in the chunk, which filtered queries check before looking at any row.
+#ifdef ECS_ARCHETYPES
+#ifndef ECS_CHUNK_SIZE
+#define ECS_CHUNK_SIZE (16 * 1024)
+#endif
+#define ECS_CHUNK_COLUMN_ALIGN 64
+#define ECS_NO_ARCHETYPE ((size_t)-1)
+
+typedef struct {
+    size_t component, add, remove;
+} ECSArchetypeEdge;
+
+typedef struct {
+    ECSArchetypeEdge *items;
+    size_t capacity, count;
+} ECSArchetypeEdges;
+
+typedef struct {
+    unsigned char **items;
+    size_t capacity, count;
+} ECSChunks;
+
+typedef struct {
+    ECSEntityMask mask;
+    ECSEntityMask columns; // `mask` without the tags, they get no column
+    size_t component_count;
+    size_t *components; // component ids, ascending
+    size_t *offsets;    // byte offset of each column inside a chunk
+    size_t *tick_offsets; // byte offset of the ticks of each column, the last one is the newest ticks of every column
+    size_t chunk_capacity, chunk_size;
+    size_t count;       // rows
+    ECSChunks chunks;
+    ECSArchetypeEdges edges;
+} ECSArchetype;
+
+typedef struct {
+    ECSArchetype *items;
+    size_t capacity, count;
+} ECSArchetypes;
+
+typedef struct ECSQuery ECSQuery;
+
+typedef struct {
+    ECSWorld *world;
+    ECSEntityMask mask;
+    ECSQuery *query;        // when set only the archetypes the query matched are visited
+    size_t cursor, archetype, chunk;
+    size_t count;           // rows in the current chunk
+    ECSEntityId *entities;  // owner of each row in the current chunk
+} ECSChunkIter;
+
+typedef struct {
+    ECSChunkIter chunk;
+    size_t row;
+    ECSEntity *entity;
+    bool keep;
+} ECSEntityIter;
+#endif // ECS_ARCHETYPES
+
+// ----------------------
+// Components
+// ----------------------
+typedef struct {
+    const char *name;
+    size_t size;
+} ECSComponentInfo;
+
+typedef struct {
+    ECSComponentInfo *items;
+    size_t capacity, count;
+} ECSComponents;
+
+typedef struct {
+    void **items;
+    size_t capacity, count;
+} ECSResources;
+
+// ----------------------
+// Cached queries
+// ----------------------
+// An ECSQuery keeps the entities (or with ECS_ARCHETYPES the archetypes) matching its mask
+// up to date as components get added and removed, so running it costs O(matches).
+// Queries with the same mask are shared, every ecs_query_create() takes a reference and needs
+// its own ecs_query_destroy().
+#ifdef ECS_ARCHETYPES
+struct ECSQuery {
+    ECSWorld *world;
+    ECSEntityMask mask;
+    size_t refs;
+    EntityIds archetypes;
+};
+#else
+typedef struct {
+    ECSWorld *world;
+    ECSEntityMask mask;
+    size_t refs;
+    ECSSparseSet matches; // zero sized values, only the entity ids are kept
+} ECSQuery;
+
+typedef struct {
+    ECSQuery *query;
+    size_t index;
+    ECSEntity *entity;
+    bool keep;
+} ECSQueryIter;
+#endif
+
+typedef struct {
+    ECSQuery **items;
+    size_t capacity, count;
+} ECSQueries;
+
+// ----------------------
+// Observers
+// ----------------------
+// Called with every entity an event happened to. Single adds, sets and removes pass one id, bulk
+// adds, ecs_despawn_entities() and ecs_cmd_flush() pass all entities of a component at once.
+// ECS_ON_ADD and ECS_ON_SET run after the value is in place (a new value raises both), ECS_ON_REMOVE
+// runs while the value can still be read, despawns included. Writes through get_ and get_mut_
+// pointers raise nothing. Observers run on the thread making the change and must not add, remove
+// or despawn on the entities they are handed, record those in an ECSCommandBuffer instead.
+typedef enum {
+    ECS_ON_ADD,
+    ECS_ON_REMOVE,
+    ECS_ON_SET,
+    ECS_EVENT_COUNT,
+} ECSEvent;
+
+typedef void (*ECSObserverFn)(ECSWorld *w, size_t component, const ECSEntityId *ids, size_t count, void *ctx);
+
+typedef struct {
+    size_t component;
+    ECSEvent event;
+    ECSObserverFn fn;
+    void *ctx;
+} ECSObserver;
+
+typedef struct {
+    ECSObserver *items;
+    size_t capacity, count;
+} ECSObservers;
+
+// ----------------------
+// Hierarchy
+// ----------------------
+// Parent/child links live next to the entity table, indexed like it. For passes over the
+// hierarchy the linked entities are also laid out breadth first in one array, tree after tree,
+// so the children of an entity sit next to each other after their parent. The array is rebuilt
+// only after the links changed. Despawning a parent despawns its subtree.
+#define ECS_HIERARCHY_NONE UINT32_MAX
+
+typedef struct {
+    uint32_t parent, first_child, last_child, prev_sibling, next_sibling;
+    uint32_t slot; // in `order`, ECS_HIERARCHY_NONE when the entity is not linked
+    bool dirty;    // also listed in `dirty`
+} ECSHierarchyNode;
+
+typedef struct {
+    ECSHierarchyNode *items;
+    size_t capacity, count;
+} ECSHierarchyNodes;
+
+typedef struct {
+    uint32_t entity; // index in the entity table
+    uint32_t parent; // slot of the parent in the same array, ECS_HIERARCHY_NONE for roots
+    uint32_t first_child, child_count; // the children take the slots [first_child, first_child + child_count)
+} ECSHierarchyEntry;
+
+typedef struct {
+    ECSHierarchyEntry *items;
+    size_t capacity, count;
+} ECSHierarchyOrder;
+
+typedef struct {
+    uint32_t *items;
+    size_t capacity, count;
+} ECSHierarchyIndices;
+
+typedef struct {
+    ECSHierarchyNodes nodes;
+    ECSHierarchyOrder order;
+    ECSHierarchyIndices dirty;  // entity indices marked since the last ecs_hierarchy_propagate()
+    ECSHierarchyIndices visits; // scratch for ecs_hierarchy_propagate(), slots of the subtree being walked
+    bool stale;                 // links changed since `order` was built
+} ECSHierarchy;
+
+// Called parent first, `parent` is NULL for the roots of the hierarchy
+typedef void (*ECSHierarchyFn)(ECSWorld *w, ECSEntity *entity, ECSEntity *parent, void *ctx);
+
+#define QueryChildren(w, child, parent) \
+    for (ECSEntity *child = ecs_first_child(w, parent); child != NULL; child = ecs_next_sibling(w, child))
+
+// ----------------------
+// World
+// ----------------------
+// A world owns its entities, component values, archetypes and queries, nothing is shared
+// between worlds except the component registry below. A zeroed ECSWorld is an empty world,
+// and independent worlds can be simulated on different threads at the same time.
+#ifndef ECS_ARCHETYPES
+typedef struct {
+    ECSSparseSet *items;
+    size_t capacity, count;
+} ECSStorages;
+#endif
+
+struct ECSWorld {
+    ECSEntities entities;
+    EntityIds dead_entities;
+    ECSQueries queries;
+    ECSObservers observers;
+    ECSEntityMask observed[ECS_EVENT_COUNT]; // components with at least one observer, per event
+    ECSHierarchy hierarchy;
+    ECSResources resources; // indexed by resource id, NULL until the resource is set
+    uint32_t tick; // stamped on the values written through get_mut_, set_ and add_
+    const ECSAllocator *allocator;
+    ECSThreadPool *pool; // parallel queries use the default pool while this is NULL
+#ifdef ECS_ARCHETYPES
+    ECSArchetypes archetypes;
+    size_t *archetype_slots; // open addressing on the mask, archetype index + 1, 0 is free
+    size_t archetype_slot_capacity;
+    size_t root_archetype; // the empty mask, index + 1 so a zeroed world has none yet
+    const ECSAllocator *chunk_allocator;
+#else
+    ECSStorages storages; // indexed by component id, grown the first time a component is used
+    unsigned char *snapshot; // loaded by ecs_world_load(), component values may still live in it
+    size_t snapshot_size;
+#endif
+};
+
+// Component ids are the same in every world. Register the components before handing worlds
+// to other threads, the registry itself is not synchronized.
+static ECSComponents ecs_components;
+// Components registered with size 0 are tags: a bit in the entity mask and nothing else,
+// no storage, no ticks, ecs_component_get() returns NULL for them
+static ECSEntityMask ecs_tags;
+#define ecs_is_tag(component) ecs_mask_test(&ecs_tags, (component))
+// Resources take their ids from the same registry, so scheduler masks can name them
+static ECSEntityMask ecs_resource_ids;
+#define ecs_is_resource(component) ecs_mask_test(&ecs_resource_ids, (component))
+
+// ----------------------
+// Memory
+// ----------------------
+// ecs_memory_stats() fills in what a world holds right now, in bytes, without touching anything.
+// `wasted` is the capacity that holds no value: room left in the arrays, and with sparse sets the
+// slots of sparse pages that point nowhere. Sparse sets grow by `growth` starting from
+// `initial_capacity`, both set per component with ecs_component_set_growth(), and never shrink on
+// their own: ecs_shrink_to_fit() trims every array down to its count and drops empty sparse pages.
+// Archetype chunks have a fixed size, so there is nothing to configure, shrinking frees the spare
+// chunk every archetype keeps.
+typedef struct {
+    const char *name;
+    size_t size;            // of one value
+    size_t count, capacity; // values stored, and room for them
+    size_t bytes;           // values and their ticks, plus ids and sparse pages with sparse sets
+    size_t wasted;
+} ECSComponentMemory;
+
+typedef struct {
+    ECSComponentMemory components[ECS_MAX_COMPONENTS]; // indexed by component id
+    size_t component_count;
+    size_t entity_count, entity_capacity, entity_bytes; // slot table, dead slots included
+    size_t free_count, free_capacity, free_bytes;       // dead slots waiting to be reused
+    size_t chunk_bytes;    // ECS_ARCHETYPES: every chunk, the component bytes above are part of it
+    size_t snapshot_bytes; // mapping of a loaded snapshot that values may still live in
+    size_t other_bytes;    // queries, observers, hierarchy, resources and archetype bookkeeping
+    size_t total_bytes, wasted_bytes;
+} ECSMemoryStats;
+
+void ecs_memory_stats(ECSWorld *w, ECSMemoryStats *stats);
+void ecs_memory_report(const ECSMemoryStats *stats, FILE *out);
+void ecs_shrink_to_fit(ECSWorld *w);
+#ifndef ECS_ARCHETYPES
+void ecs_component_set_growth(ECSWorld *w, size_t component, size_t initial_capacity, float growth);
+#endif
+
+// ----------------------
+// Profiling
+// ----------------------
+// Compiled in with ECS_PROFILE, otherwise every hook below expands to nothing. Each System
+// without extra parameters records one event per call: wall time, the world tick as the frame,
+// and how many entities its queries visited (masks tested, rows walked) and matched (handed to
+// the loop body). `ProfileZone(w, "name") { ... }` records any other block the same way, a
+// `break`, `return` or `goto` out of it still ends the zone. Zones end innermost first. Every task of ecs_query_par_each() records an
+// event too, on the thread that ran it, named after the zone that started the query and flagged
+// as a task. Events go to a ring of ECS_PROFILE_RING per
+// thread that only its own thread writes, the oldest ones get overwritten.
+// ecs_profile_export() writes everything still in the rings as Chrome trace-event JSON, for
+// chrome://tracing or ui.perfetto.dev. Export and reset between frames, not while systems run.
+//
+// ECS_PROFILE_COUNTERS (Linux only, implies ECS_PROFILE) also opens perf_event_open counters
+// per thread and stores how much each zone moved them. ecs_profile_report() sums the events
+// per system or zone: IPC, and cache and branch misses per matched entity. Counters the kernel
+// refuses (perf_event_paranoid above 2, no PMU in a VM) read as zero. A thread's counters are
+// closed when it exits, ecs_profile_shutdown() closes those of every thread at once.
+#ifdef ECS_PROFILE_COUNTERS
+#ifndef __linux__
+#error "ECS_PROFILE_COUNTERS needs perf_event_open, which is Linux only"
+#endif
+#ifndef ECS_PROFILE
+#define ECS_PROFILE
+#endif
+#endif
+
+#ifdef ECS_PROFILE
+#include <stdatomic.h>
+#include <time.h>
+#ifdef ECS_PROFILE_COUNTERS
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifndef ECS_PROFILE_RING
+#define ECS_PROFILE_RING 4096
+#endif
+
+typedef struct {
+    size_t visited, matched;
+} ECSProfileCounters;
+
+#ifdef ECS_PROFILE_COUNTERS
+typedef enum {
+    ECS_COUNTER_CYCLES,
+    ECS_COUNTER_INSTRUCTIONS,
+    ECS_COUNTER_L1D_MISSES,
+    ECS_COUNTER_LLC_MISSES,
+    ECS_COUNTER_BRANCH_MISSES,
+    ECS_COUNTER_COUNT,
+} ECSCounter;
+#endif
+
+typedef struct {
+    const char *name;
+    uint64_t start, duration; // nanoseconds, CLOCK_MONOTONIC
+    size_t visited, matched;
+    uint32_t frame;
+    bool task; // one task of ecs_query_par_each()
+#ifdef ECS_PROFILE_COUNTERS
+    uint64_t hardware[ECS_COUNTER_COUNT];
+#endif
+} ECSProfileEvent;
+
+typedef struct ECSProfileRing ECSProfileRing;
+struct ECSProfileRing {
+    ECSProfileEvent events[ECS_PROFILE_RING];
+    _Atomic size_t head; // events ever written, the newest is at (head - 1) % ECS_PROFILE_RING
+    size_t thread;
+    ECSProfileRing *next;
+#ifdef ECS_PROFILE_COUNTERS
+    int leader;                      // group fd of this thread's counters, -1 when none opened
+    int fds[ECS_COUNTER_COUNT];      // -1 when refused or closed
+    int slots[ECS_COUNTER_COUNT];    // position of each counter in a group read, -1 when refused
+#endif
+};
+
+typedef struct {
+    const char *name;
+    const char *outer; // zone that was open when this one began
+    uint64_t start;
+    ECSProfileCounters counters;
+    uint32_t frame;
+    bool task;
+#ifdef ECS_PROFILE_COUNTERS
+    uint64_t hardware[ECS_COUNTER_COUNT];
+#endif
+} ECSProfileZone;
+
+// what the queries of the calling thread went through so far, zones keep the difference
+static _Thread_local ECSProfileCounters ecs_profile_counters;
+#define ecs_profile_count(counter, n) (ecs_profile_counters.counter += (n))
+// innermost zone open on the calling thread, parallel tasks are named after it
+static _Thread_local const char *ecs_profile_zone;
+
+ECSProfileZone ecs_profile_begin(ECSWorld *w, const char *name);
+void ecs_profile_end(ECSProfileZone *zone);
+bool ecs_profile_export(const char *path);
+void ecs_profile_report(FILE *out);
+void ecs_profile_reset();
+void ecs_profile_shutdown();
+
+// ends the zone when the block is left early, the loop itself ends it otherwise
+static inline void ecs_profile_zone_leave(ECSProfileZone *zone) {
+    if(zone->name != NULL) ecs_profile_end(zone);
+}
+
+#define ProfileZone(w, label) \
+    for (ECSProfileZone ecs_zone __attribute__((cleanup(ecs_profile_zone_leave))) = ecs_profile_begin((w), (label)); \
+         ecs_zone.name != NULL; ecs_profile_end(&ecs_zone), ecs_zone.name = NULL)
+#define ECS_SYSTEM_PROFILED(name) \
+    static void name##_system_body(ECSWorld *world); \
+    void name##_system(ECSWorld *world) { \
+        ECSProfileZone zone = ecs_profile_begin(world, #name); \
+        name##_system_body(world); \
+        ecs_profile_end(&zone); \
+    } \
+    static void name##_system_body(ECSWorld *world)
+#else
+#define ecs_profile_count(counter, n) ((void)0)
+#define ProfileZone(w, label)
+#define ECS_SYSTEM_PROFILED(name) void name##_system(ECSWorld *world)
+#endif
+
+#ifndef ECS_ARCHETYPES
+// ----------------------
+// Linear scan
+// ----------------------
+#ifndef ECS_SCAN_BATCH
+#define ECS_SCAN_BATCH 64
+#endif
+
+typedef struct {
+    ECSWorld *world;
+    ECSEntityMask mask;
+    size_t base, next;        // first entity of the current batch and of the next one
+    size_t count, cursor;     // matches in the current batch and how many were visited
+    uint32_t matches[ECS_SCAN_BATCH];
+    ECSEntity *entity;
+    bool keep;
+} ECSScanIter;
+
+static inline ECSScanIter ecs_scan_iter(ECSWorld *w, ECSEntityMask mask) {
+    ECSScanIter it;
+    it.world = w;
+    it.mask = mask;
+    it.base = it.next = it.count = it.cursor = 0;
+    it.entity = NULL;
+    it.keep = true;
+    return it;
 }
 
-void ecs_deinit() {
-    free(ecs_entities.items);
-    free(ecs_dead_entities.items);
-    ecs_da_foreach(ECSComponentsCleanupCallback, it, &ecs_components_cleanups) {
-        (*it)();
+static inline bool ecs_scan_iter_next(ECSScanIter *it) {
+    for(;;) {
+        while(it->cursor < it->count) {
+            ECSEntity *e = &it->world->entities.items[it->base + it->matches[it->cursor++]];
+            // the body may have changed masks further down the batch since it was filtered
+            if(!ecs_mask_contains(&e->mask, &it->mask)) continue;
+            ecs_profile_count(matched, 1);
+            it->entity = e;
+            return true;
+        }
+        if(it->next >= it->world->entities.count) return false;
+        size_t n = it->world->entities.count - it->next;
+        if(n > ECS_SCAN_BATCH) n = ECS_SCAN_BATCH;
+        it->base = it->next;
+        it->next += n;
+        it->cursor = 0;
+        ecs_profile_count(visited, n);
+        it->count = ecs_mask_filter(&it->world->entities.items[it->base], n, &it->mask, it->matches);
     }
-    free(ecs_components_cleanups.items);
 }
+#endif
+
+// ----------------------
+// Change detection
+// ----------------------
+// A typical consumer remembers the tick it last ran at:
+//     QueryFiltered(w, e, last_sync, Changed(Position)) { ... }
+//     last_sync = ecs_world_advance_tick(w);
+// Writes through plain get_ pointers are not tracked.
+typedef struct {
+    ECSEntityMask mask, changed, added;
+    uint32_t since;
+} ECSFilter;
+
+typedef struct {
+    ECSWorld *world;
+    ECSFilter filter;
+#ifdef ECS_ARCHETYPES
+    ECSChunkIter chunk;
+    size_t row;
+#else
+    size_t driver;   // the rows of this component's storage are walked
+    size_t index, block;
+    size_t term;     // tick of the driver that gets tested per block, or ECS_NO_COMPONENT
+#endif
+    ECSEntity *entity;
+    bool keep;
+} ECSFilterIter;
+
+// ----------------------
+// Parallel queries
+// ----------------------
+// ecs_query_par_each() splits the matching entities into tasks (ECS_PAR_GRAIN entities, or one
+// chunk with ECS_ARCHETYPES) and runs them on a pool of pthreads, the calling thread included.
+// Every worker starts on its own contiguous range of tasks and steals from the back of the
+// others once it runs dry. With ECS_PAR_DETERMINISTIC nothing is stolen: a given world and
+// thread count always map the same entities to the same worker, each visited in ascending order,
+// so per-worker results (see ecs_worker_index()) are reproducible.
+// `fn` may write to the components of the entity it gets, but must not spawn, despawn, add or
+// remove anything while the query runs.
+#ifndef ECS_PAR_GRAIN
+#define ECS_PAR_GRAIN 1024
+#endif
+#define ECS_PAR_DETERMINISTIC 1
+
+typedef void (*ECSParEachFn)(ECSWorld *w, ECSEntity *e, void *ctx);
+
+typedef struct {
+    size_t *items; // archetype and chunk of each task, interleaved
+    size_t capacity, count;
+} ECSParTasks;
+
+#ifndef ECS_NO_THREADS
+typedef struct {
+    _Atomic uint64_t range; // next task in the low 32 bits, end in the high 32
+    char padding[64 - sizeof(uint64_t)];
+} ECSWorkerQueue;
+
+// Task `task` of a job, ran by whichever worker took it
+typedef void (*ECSPoolTaskFn)(void *data, size_t task);
+
+typedef struct {
+    ECSPoolTaskFn run;
+    void *data;
+    unsigned flags;
+} ECSPoolJob;
+
+struct ECSThreadPool {
+    size_t count; // workers, the thread that submits a job is worker 0
+    pthread_t *threads;
+    ECSWorkerQueue *queues;
+    pthread_mutex_t submit; // one job at a time, other submitters wait here
+    pthread_mutex_t lock;
+    pthread_cond_t wake, done;
+    size_t generation, running;
+    bool quit;
+    ECSPoolJob job;
+    ECSParTasks tasks;
+};
+#endif
+
+void ecs_query_par_each(ECSWorld *w, ECSEntityMask mask, ECSParEachFn fn, void *ctx);
+void ecs_query_par_each_ex(ECSWorld *w, ECSEntityMask mask, ECSParEachFn fn, void *ctx, unsigned flags);
+size_t ecs_worker_index();
+#ifndef ECS_NO_THREADS
+void ecs_thread_pool_init(ECSThreadPool *pool, size_t threads);
+void ecs_thread_pool_destroy(ECSThreadPool *pool);
+void ecs_thread_pool_run(ECSThreadPool *pool, size_t task_count, unsigned flags, ECSPoolTaskFn run, void *data);
+void ecs_set_thread_pool(ECSWorld *w, ECSThreadPool *pool);
+#endif
+
+// ----------------------
+// Scheduler
+// ----------------------
+// Systems are registered with the components they read and the ones they write. Two systems
+// conflict when one writes a component the other reads or writes: conflicting systems always run
+// in the order they were added, the others run at the same time on the world's thread pool.
+// A system that spawns, despawns, adds or removes components, or touches state outside of the
+// world, must declare ecs_mask_all() as its writes so it runs on its own.
+typedef void (*ECSSystemFn)(ECSWorld *world);
+
+typedef struct {
+    size_t *items;
+    size_t capacity, count;
+} ECSSystemIds;
+
+typedef struct {
+    const char *name;
+    ECSSystemFn fn;
+    ECSEntityMask reads, writes;
+    size_t depends_on;       // conflicting systems added before this one
+    ECSSystemIds dependents; // conflicting systems added after this one
+} ECSSystem;
+
+typedef struct {
+    ECSSystem *items;
+    size_t capacity, count;
+} ECSSystems;
+
+typedef struct {
+    ECSSystems systems;
+#ifndef ECS_NO_THREADS
+    // state of the run in progress
+    ECSWorld *world;
+    size_t *waiting; // dependencies of each system that haven't finished yet
+    ECSSystemIds ready;
+    size_t finished;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+#endif
+} ECSScheduler;
+
+// `ecs_schedule(&scheduler, move_rects, ecs_mask(COMP_Velocity), ecs_mask(COMP_Rect))` adds `move_rects_system`,
+// resources go in the same masks: `ecs_mask(COMP_Velocity, COMP_Time)`
+#define ecs_schedule(scheduler, name, reads, writes) ecs_scheduler_add((scheduler), #name, name##_system, (reads), (writes))
+
+size_t ecs_scheduler_add(ECSScheduler *s, const char *name, ECSSystemFn fn, ECSEntityMask reads, ECSEntityMask writes);
+void ecs_scheduler_run(ECSScheduler *s, ECSWorld *w);
+void ecs_scheduler_free(ECSScheduler *s);
+
+// ----------------------
+// Command buffers
+// ----------------------
+// Structural changes recorded while iterating and applied later by ecs_cmd_flush(), so no storage
+// moves under a live query. ecs_cmd_spawn() hands out a pending id that the other commands of the
+// same buffer accept, it turns into a real entity on flush.
+// The flush sorts the commands by component and entity, keeps only the last command for each
+// entity and component, then spawns in one go, adds each component in bulk, removes, and despawns
+// last. A buffer is not synchronized, give each thread its own.
+#define ecs_entity_is_pending(id) (((id) & ECS_ENTITY_DEAD) != 0)
+
+typedef enum {
+    ECS_CMD_ADD,
+    ECS_CMD_REMOVE,
+    ECS_CMD_DESPAWN,
+} ECSCommandKind;
+
+typedef struct {
+    ECSCommandKind kind;
+    ECSEntityId entity;
+    size_t component;
+    size_t value; // offset into `values`
+    size_t seq;
+} ECSCommand;
+
+typedef struct {
+    ECSCommand *items;
+    size_t capacity, count;
+} ECSCommands;
+
+typedef struct {
+    unsigned char *items;
+    size_t capacity, count;
+} ECSCommandBytes;
+
+typedef struct {
+    ECSCommands commands;
+    ECSCommandBytes values;
+    size_t spawns;
+    EntityIds scratch_ids, scratch_removes;
+    ECSCommandBytes scratch_values;
+    const ECSAllocator *allocator;
+} ECSCommandBuffer;
+
+ECSEntityId ecs_cmd_spawn(ECSCommandBuffer *cb);
+void ecs_cmd_despawn(ECSCommandBuffer *cb, ECSEntityId id);
+void ecs_cmd_add(ECSCommandBuffer *cb, ECSEntityId id, size_t component, const void *value);
+void ecs_cmd_remove(ECSCommandBuffer *cb, ECSEntityId id, size_t component);
+void ecs_cmd_flush(ECSCommandBuffer *cb, ECSWorld *w, ECSEntityId *spawned);
+void ecs_cmd_free(ECSCommandBuffer *cb);
+
+// ----------------------
+// Snapshots
+// ----------------------
+// Binary image of a world in native byte order: a header, a table with one entry per component,
+// the entity ids, their masks, the free list, and for each component the ids, ticks and values of
+// every entity that has it. Every section starts at a multiple of ECS_SNAPSHOT_ALIGN.
+// Components are matched by name on load, so registration order may change between runs, but
+// every saved component has to be registered with the same size.
+// ecs_world_load() takes an empty world. The file is mapped copy-on-write and, in sparse mode,
+// component values are used in place until their storage has to grow. Archetype mode copies the
+// values into chunks. Loading raises no observer events.
+// Only entities and their components are saved: resources and parent links are not, set them
+// up again after loading.
+#ifndef ECS_SNAPSHOT_ALIGN
+#define ECS_SNAPSHOT_ALIGN 64
+#endif
+#define ECS_SNAPSHOT_MAGIC "ECSW"
+#define ECS_SNAPSHOT_VERSION 1
+#define ECS_SNAPSHOT_NAME_MAX 48
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t tick;
+    uint64_t mask_words;
+    uint64_t entity_count, entities, masks; // ids and masks of every entity slot
+    uint64_t dead_count, dead;              // indices of the free slots
+    uint64_t component_count;               // entries of the table right after the header
+} ECSSnapshotHeader;
+
+typedef struct {
+    char name[ECS_SNAPSHOT_NAME_MAX];
+    uint64_t size, count;
+    uint64_t ids, ticks, data; // file offsets of `count` ids, ECSTicks and values
+} ECSSnapshotComponent;
+
+bool ecs_world_save(ECSWorld *w, const char *path);
+bool ecs_world_load(ECSWorld *w, const char *path);
+
+// ----------------------
+// Replication
+// ----------------------
+// The sender keeps a `mirror` world that holds what the receiver last got. ecs_delta_encode()
+// writes what changed since then and applies it to the mirror, and ecs_delta_apply() brings the
+// receiving world to the same state. A delta carries the entity slots whose id or mask changed,
+// the free list when it changed, and for every component the values that differ from the mirror:
+// XORed with the old value (or zeros) and run-length encoded, so untouched fields cost a byte.
+// Only values written at or after the mirror's tick are compared, writes through plain get_
+// pointers are never sent. Both sides must register the same components in the same order, and
+// the receiver must not spawn or despawn on its own. Entities keep their ids on the receiver and
+// its observers see the adds, sets, removes and despawns.
+#define ECS_DELTA_MAGIC "ECSD"
+#define ECS_DELTA_VERSION 1
+
+typedef struct {
+    unsigned char *items;
+    size_t capacity, count;
+    const ECSAllocator *allocator;
+} ECSDelta;
+
+void ecs_delta_encode(ECSWorld *w, ECSWorld *mirror, ECSDelta *out);
+bool ecs_delta_apply(ECSWorld *w, const void *data, size_t size);
+void ecs_delta_free(ECSDelta *delta);
+
+// ----------------------
+// Spatial index
+// ----------------------
+// Uniform grid over the entities that have a position component, stored as a hash of the
+// non-empty cells, each cell holding a list of entities. `position` reads x and y out of a
+// component value, `ecs_spatial_position(Position, x, y)` writes one for a struct with such fields.
+// Adds, set_ calls, removes and despawns are picked up by observers right away, writes through
+// get_mut_ pointers once ecs_spatial_sync() runs, and writes through plain get_ pointers never.
+// A sync only looks at the writes since the previous one, advance the world tick in between or
+// every sync goes over the writes of the current tick again.
+// The index registers itself by address, don't move it before ecs_spatial_free().
+// Positions can't be NaN, queries with NaN bounds match nothing. Coordinates beyond the int32
+// range of cells share the outermost cells.
+// Don't change the indexed component while iterating the index, record those in a command buffer.
+#define ECS_SPATIAL_NONE UINT32_MAX
+
+typedef void (*ECSSpatialPositionFn)(const void *value, float *x, float *y);
+
+// `ecs_spatial_position(Position, x, y)` defines `Position_spatial_position`
+#define ecs_spatial_position(name, x_field, y_field) \
+    static void name##_spatial_position(const void *value, float *x, float *y) { \
+        *x = (float)((const name*)value)->x_field; \
+        *y = (float)((const name*)value)->y_field; \
+    }
+
+typedef struct {
+    float x, y;
+    int32_t cell_x, cell_y;
+    uint32_t prev, next; // neighbours in the cell, indexed like the entities
+    bool present;
+} ECSSpatialNode;
+
+typedef struct {
+    ECSSpatialNode *items;
+    size_t capacity, count;
+} ECSSpatialNodes;
+
+typedef struct {
+    int32_t x, y;
+    uint32_t head;
+    bool used;
+} ECSSpatialCell;
+
+typedef struct {
+    ECSWorld *world;
+    size_t component;
+    float cell_size;
+    ECSSpatialPositionFn position;
+    ECSSpatialNodes nodes;
+    ECSSpatialCell *cells; // open addressing, power of two capacity
+    size_t cell_capacity, cell_count;
+    uint32_t since;        // tick of the last ecs_spatial_sync()
+    bool synced;
+} ECSSpatialIndex;
+
+typedef struct {
+    ECSSpatialIndex *index;
+    float min_x, min_y, max_x, max_y;
+    float center_x, center_y, radius2;
+    bool round;
+    int32_t cell_min_x, cell_min_y, cell_max_x, cell_max_y, cell_x, cell_y;
+    bool scan;   // the box covers more cells than exist, walk the table instead
+    bool done;
+    size_t slot;
+    uint32_t node;
+    ECSEntity *entity;
+    bool keep;
+} ECSSpatialIter;
+
+#define QueryAabb(index, e, min_x, min_y, max_x, max_y) \
+    for (ECSSpatialIter e##_it = ecs_spatial_aabb(index, min_x, min_y, max_x, max_y); e##_it.keep && ecs_spatial_iter_next(&e##_it); e##_it.keep = !e##_it.keep) \
+        for (ECSEntity *e __attribute__((unused)) = e##_it.entity; e##_it.keep; e##_it.keep = !e##_it.keep)
+#define QueryRadius(index, e, x, y, radius) \
+    for (ECSSpatialIter e##_it = ecs_spatial_radius(index, x, y, radius); e##_it.keep && ecs_spatial_iter_next(&e##_it); e##_it.keep = !e##_it.keep) \
+        for (ECSEntity *e __attribute__((unused)) = e##_it.entity; e##_it.keep; e##_it.keep = !e##_it.keep)
+#define QueryPoint(index, e, x, y) QueryAabb(index, e, x, y, x, y)
+
+void ecs_spatial_init(ECSSpatialIndex *index, ECSWorld *w, size_t component, float cell_size, ECSSpatialPositionFn position);
+void ecs_spatial_sync(ECSSpatialIndex *index);
+void ecs_spatial_free(ECSSpatialIndex *index);
+ECSSpatialIter ecs_spatial_aabb(ECSSpatialIndex *index, float min_x, float min_y, float max_x, float max_y);
+ECSSpatialIter ecs_spatial_radius(ECSSpatialIndex *index, float x, float y, float radius);
+bool ecs_spatial_iter_next(ECSSpatialIter *it);
+
+// ----------------------
+// Helpers
+// ----------------------
+
+ECSEntity* ecs_spawn_entity(ECSWorld *w);
+void ecs_spawn_entities(ECSWorld *w, size_t count, ECSEntityId *out_ids);
+void ecs_despawn_entities(ECSWorld *w, const ECSEntityId *ids, size_t count);
+void ecs_despawn_entity(ECSWorld *w, ECSEntity *e);
+void ecs_despawn_entity_with_id(ECSWorld *w, ECSEntityId id);
+ECSEntity* ecs_get_entity_with_id(ECSWorld *w, ECSEntityId id);
+bool ecs_is_alive(ECSWorld *w, ECSEntityId id);
+bool ecs_has_components(ECSEntity* e, ECSEntityMask mask) ;
+size_t ecs_component_type_iota();
+void ecs_deinit(ECSWorld *w);
+ECSEntityMask ecs_mask_of(const size_t *components, size_t count);
+
+size_t ecs_register_component(const char *name, size_t size);
+// Resources are singletons like the frame time or the game state, stored by the world in a slot
+// per resource id instead of on an entity, so fetching one is an index and never a query. No
+// entity can hold a resource. Setting one the first time allocates it, do that before running
+// systems in parallel. Snapshots and deltas don't carry resources.
+size_t ecs_register_resource(const char *name, size_t size);
+void* ecs_resource_get(ECSWorld *w, size_t resource); // NULL until set
+void* ecs_resource_set(ECSWorld *w, size_t resource, const void *value); // NULL `value` zeroes it
+void ecs_resource_remove(ECSWorld *w, size_t resource);
+void* ecs_component_get(ECSWorld *w, ECSEntity *e, size_t component);
+void* ecs_component_add(ECSWorld *w, ECSEntity *e, size_t component, const void *value);
+void ecs_component_remove(ECSWorld *w, ECSEntity *e, size_t component);
+void ecs_component_add_bulk(ECSWorld *w, size_t component, const ECSEntityId *ids, const void *values, size_t count);
+void* ecs_component_get_mut(ECSWorld *w, ECSEntity *e, size_t component);
+void ecs_component_set(ECSWorld *w, ECSEntity *e, size_t component, const void *value);
+const uint32_t* ecs_component_ticks(ECSWorld *w, ECSEntity *e, size_t component);
+uint32_t ecs_world_tick(ECSWorld *w);
+uint32_t ecs_world_advance_tick(ECSWorld *w);
+ECSFilter ecs_filter_of(const size_t *terms, size_t count, uint32_t since);
+ECSFilterIter ecs_filter_iter(ECSWorld *w, ECSFilter filter);
+bool ecs_filter_iter_next(ECSFilterIter *it);
+void ecs_observe(ECSWorld *w, size_t component, ECSEvent event, ECSObserverFn fn, void *ctx);
+void ecs_unobserve(ECSWorld *w, size_t component, ECSEvent event, ECSObserverFn fn, void *ctx);
+void ecs_set_parent(ECSWorld *w, ECSEntity *child, ECSEntity *parent);
+ECSEntity* ecs_get_parent(ECSWorld *w, ECSEntity *e);
+ECSEntity* ecs_first_child(ECSWorld *w, ECSEntity *e);
+ECSEntity* ecs_next_sibling(ECSWorld *w, ECSEntity *e);
+void ecs_hierarchy_mark(ECSWorld *w, ECSEntity *e);
+void ecs_hierarchy_propagate(ECSWorld *w, size_t component, uint32_t since, ECSHierarchyFn fn, void *ctx);
+#ifndef ECS_ARCHETYPES
+ECSSparseSet* ecs_world_storage(ECSWorld *w, size_t component);
+#endif
+
+ECSQuery* ecs_query_create(ECSWorld *w, ECSEntityMask mask);
+void ecs_query_destroy(ECSQuery *q);
+size_t ecs_query_count(ECSQuery *q);
+
+#ifdef ECS_ARCHETYPES
+ECSChunkIter ecs_query_chunk_iter(ECSQuery *q);
+ECSEntityIter ecs_query_entity_iter(ECSQuery *q);
+#else
+ECSQueryIter ecs_query_iter(ECSQuery *q);
+bool ecs_query_iter_next(ECSQueryIter *it);
+#endif
+
+#ifdef ECS_ARCHETYPES
+ECSChunkIter ecs_chunk_iter(ECSWorld *w, ECSEntityMask mask);
+bool ecs_chunk_iter_next(ECSChunkIter *it);
+void* ecs_chunk_column(ECSChunkIter *it, size_t component);
+ECSEntityIter ecs_entity_iter(ECSWorld *w, ECSEntityMask mask);
+bool ecs_entity_iter_next(ECSEntityIter *it);
+#endif
+
+void* ecs_mem_alloc(const ECSAllocator *allocator, size_t size);
+void* ecs_mem_realloc(const ECSAllocator *allocator, void *ptr, size_t old_size, size_t new_size);
+void ecs_mem_free(const ECSAllocator *allocator, void *ptr, size_t size);
+void* ecs_mem_shrink(const ECSAllocator *allocator, void *ptr, size_t old_size, size_t new_size);
+void ecs_set_allocator(ECSWorld *w, const ECSAllocator *allocator);
+#ifdef ECS_ARCHETYPES
+void ecs_set_chunk_allocator(ECSWorld *w, const ECSAllocator *allocator);
+#else
+void ecs_component_set_allocator(ECSWorld *w, size_t component, const ECSAllocator *allocator);
+#endif
+
+void ecs_arena_init(ECSArena *arena, size_t block_size, const ECSAllocator *parent);
+void* ecs_arena_alloc(ECSArena *arena, size_t size);
+void ecs_arena_reset(ECSArena *arena);
+void ecs_arena_destroy(ECSArena *arena);
+ECSAllocator ecs_arena_allocator(ECSArena *arena);
+
+void ecs_pool_init(ECSPool *pool, size_t block_size, size_t blocks_per_slab, const ECSAllocator *parent);
+void* ecs_pool_alloc(ECSPool *pool, size_t size);
+void ecs_pool_release(ECSPool *pool, void *ptr, size_t size);
+void ecs_pool_destroy(ECSPool *pool);
+ECSAllocator ecs_pool_allocator(ECSPool *pool);
+
+void ecs_sparse_reserve(ECSSparseSet *set, size_t count);
+bool ecs_sparse_contains(ECSSparseSet *set, ECSEntityId id);
+void* ecs_sparse_get(ECSSparseSet *set, ECSEntityId id);
+void* ecs_sparse_insert(ECSSparseSet *set, ECSEntityId id, const void *value);
+bool ecs_sparse_remove(ECSSparseSet *set, ECSEntityId id);
+ECSEntityId ecs_sparse_entity_of(ECSSparseSet *set, const void *value);
+void ecs_sparse_free(ECSSparseSet *set);
+
+// #define  ECS_IMPLEMENTATION
+#ifdef ECS_IMPLEMENTATION
+
+#ifdef ECS_ARCHETYPES
+static size_t ecs_archetype_find(ECSWorld *w, ECSEntityMask mask);
+static size_t ecs_archetype_root(ECSWorld *w);
+static size_t ecs_archetype_push(ECSWorld *w, size_t archetype, ECSEntityId id);
+static void ecs_archetype_pop(ECSWorld *w, size_t archetype, size_t row);
+static void ecs_archetype_reserve(ECSWorld *w, size_t archetype, size_t count);
+static bool ecs_chunk_iter_step(ECSChunkIter *it);
+#else
+static void ecs_queries_update(ECSWorld *w, ECSEntity *e, ECSEntityMask old_mask);
+#endif
+static size_t* ecs_sparse_slot(ECSSparseSet *set, ECSEntityId id, bool create);
+static ECSTicks* ecs_component_ticks_of(ECSWorld *w, ECSEntity *e, size_t component);
+static void ecs_component_touch(ECSWorld *w, ECSEntity *e, size_t component, bool added);
+static bool ecs_filter_match(ECSWorld *w, ECSEntity *e, const ECSFilter *f);
+static void* ecs_component_attach(ECSWorld *w, ECSEntity *e, size_t component, const void *value);
+static void ecs_entity_release(ECSWorld *w, ECSEntity *e);
+static void ecs_entity_free_slot(ECSWorld *w, ECSEntity *e);
+static void ecs_entity_emit_removes(ECSWorld *w, ECSEntity *e);
+static void ecs_emit(ECSWorld *w, size_t component, ECSEvent event, const ECSEntityId *ids, size_t count);
+static size_t ecs_collect(ECSWorld *w, size_t component, bool has, const ECSEntityId *ids, size_t count, ECSEntityId *out);
+static void ecs_component_detach(ECSWorld *w, ECSEntity *e, size_t component);
+static void ecs_component_attach_bulk(ECSWorld *w, size_t component, const ECSEntityId *ids, const void *values, size_t count);
+static void ecs_snapshot_release(ECSWorld *w, unsigned char *base, size_t size);
+static void ecs_hierarchy_release(ECSWorld *w, uint32_t index);
+static void ecs_hierarchy_detach(ECSWorld *w, uint32_t index);
+static void ecs_hierarchy_despawn_children(ECSWorld *w, uint32_t index);
+
+ECSEntity* ecs_spawn_entity(ECSWorld *w) {
+    size_t index;
+    if(w->dead_entities.count > 0) {
+       index = ecs_da_last(&w->dead_entities);
+       w->dead_entities.count--;
+       w->entities.items[index].id &= ~ECS_ENTITY_DEAD;
+    } else {
+        index = w->entities.count;
+        ECS_ASSERT(index <= ECS_ENTITY_INDEX_MASK && "Out of entity ids");
+        ECSEntity e = {
+            .id = ecs_entity_make_id(index, 0),
+        };
+        ecs_da_append_with(w->allocator, &w->entities, e);
+    }
+#ifdef ECS_ARCHETYPES
+    size_t root = ecs_archetype_root(w);
+    w->entities.items[index].archetype = root;
+    w->entities.items[index].row = ecs_archetype_push(w, root, w->entities.items[index].id);
+#endif
+    return &w->entities.items[index];
+}
+
+void ecs_spawn_entities(ECSWorld *w, size_t count, ECSEntityId *out_ids) {
+    size_t recycled = count < w->dead_entities.count ? count : w->dead_entities.count;
+    ecs_da_reserve_with(w->allocator, &w->entities, w->entities.count + count - recycled);
+#ifdef ECS_ARCHETYPES
+    size_t root = ecs_archetype_root(w);
+    ecs_archetype_reserve(w, root, w->archetypes.items[root].count + count);
+#endif
+    for(size_t i = 0; i < count; ++i) {
+        // nothing below reallocates anymore, so this is just the bookkeeping of a single spawn
+        ECSEntity *e = ecs_spawn_entity(w);
+        if(out_ids != NULL) out_ids[i] = e->id;
+    }
+}
+
+void ecs_despawn_entities(ECSWorld *w, const ECSEntityId *ids, size_t count) {
+    // subtrees go first and one by one, so a child listed here as well isn't reported twice
+    for(size_t i = 0; i < count && w->hierarchy.nodes.count > 0; ++i) {
+        if(ecs_is_alive(w, ids[i])) ecs_hierarchy_despawn_children(w, (uint32_t)ecs_entity_index(ids[i]));
+    }
+    ECSEntityId *removed = NULL;
+    for(size_t i = 0; i < ECS_MASK_WORDS; ++i) {
+        for(uint64_t bits = w->observed[ECS_ON_REMOVE].words[i]; bits != 0; bits &= bits - 1) {
+            size_t c = i * 64 + (size_t)__builtin_ctzll(bits);
+            if(removed == NULL) removed = ecs_mem_alloc(w->allocator, count * sizeof(ECSEntityId));
+            ECS_ASSERT(removed != NULL && "Buy more RAM lol");
+            ecs_emit(w, c, ECS_ON_REMOVE, removed, ecs_collect(w, c, true, ids, count, removed));
+        }
+    }
+    if(removed != NULL) ecs_mem_free(w->allocator, removed, count * sizeof(ECSEntityId));
+    ecs_da_reserve_with(w->allocator, &w->dead_entities, w->dead_entities.count + count);
+    for(size_t i = 0; i < count; ++i) {
+        ECSEntity *e = ecs_get_entity_with_id(w, ids[i]);
+        if(e != NULL) ecs_entity_release(w, e);
+    }
+}
+
+void ecs_despawn_entity(ECSWorld *w, ECSEntity *e) {
+    if(e->id & ECS_ENTITY_DEAD) return;
+    ecs_entity_emit_removes(w, e);
+    ecs_entity_release(w, e);
+}
+
+static void ecs_entity_emit_removes(ECSWorld *w, ECSEntity *e) {
+    ECSEntityId id = e->id;
+    for(size_t i = 0; i < ECS_MASK_WORDS; ++i) {
+        for(uint64_t bits = w->observed[ECS_ON_REMOVE].words[i] & e->mask.words[i]; bits != 0; bits &= bits - 1) {
+            ecs_emit(w, i * 64 + (size_t)__builtin_ctzll(bits), ECS_ON_REMOVE, &id, 1);
+        }
+    }
+}
+
+// Frees the slot and the values of a live entity without telling the observers
+static void ecs_entity_release(ECSWorld *w, ECSEntity *e) {
+    ecs_hierarchy_release(w, (uint32_t)ecs_entity_index(e->id));
+    ecs_entity_free_slot(w, e);
+    ecs_da_append_with(w->allocator, &w->dead_entities, ecs_entity_index(e->id));
+}
+
+// Drops the values of a live entity and marks its slot dead, the free list is left alone
+static void ecs_entity_free_slot(ECSWorld *w, ECSEntity *e) {
+#ifdef ECS_ARCHETYPES
+    ecs_archetype_pop(w, e->archetype, e->row);
+    e->archetype = ECS_NO_ARCHETYPE;
+    e->mask = (ECSEntityMask){0};
+#else
+    ECSEntityMask old_mask = e->mask;
+    e->mask = (ECSEntityMask){0};
+    ecs_queries_update(w, e, old_mask);
+    // give the values back so packed storage only ever holds live entities
+    for(size_t i = 0; i < ECS_MASK_WORDS; ++i) {
+        for(uint64_t bits = old_mask.words[i] & ~ecs_tags.words[i]; bits != 0; bits &= bits - 1) {
+            ecs_sparse_remove(&w->storages.items[i * 64 + (size_t)__builtin_ctzll(bits)], e->id);
+        }
+    }
+#endif
+    e->id = ecs_entity_make_id(ecs_entity_index(e->id), ecs_entity_generation(e->id) + 1) | ECS_ENTITY_DEAD;
+}
+
+void ecs_despawn_entity_with_id(ECSWorld *w, ECSEntityId id) {
+    ECSEntity *e = ecs_get_entity_with_id(w, id);
+    if(e != NULL) ecs_despawn_entity(w, e);
+}
+
+ECSEntity* ecs_get_entity_with_id(ECSWorld *w, ECSEntityId id) {
+    size_t index = ecs_entity_index(id);
+    if(index >= w->entities.count || w->entities.items[index].id != id) return NULL;
+    return &w->entities.items[index];
+}
+
+bool ecs_is_alive(ECSWorld *w, ECSEntityId id) {
+    size_t index = ecs_entity_index(id);
+    return index < w->entities.count && w->entities.items[index].id == id;
+}
+
+bool ecs_has_components(ECSEntity* e, ECSEntityMask mask) {
+    return ecs_mask_contains(&e->mask, &mask);
+}
+
+ECSEntityMask ecs_mask_of(const size_t *components, size_t count) {
+    ECSEntityMask mask = {0};
+    for(size_t i = 0; i < count; ++i) {
+        ECS_ASSERT(components[i] < ECS_MAX_COMPONENTS && "Component is not registered");
+        ecs_mask_set(&mask, components[i]);
+    }
+    return mask;
+}
+
+size_t ecs_component_type_iota() {
+    static size_t id = 0;
+    return id++;
+}
+
+size_t ecs_register_component(const char *name, size_t size) {
+    size_t id = ecs_component_type_iota();
+    ECS_ASSERT(id == ecs_components.count);
+    ECS_ASSERT(id < ECS_MAX_COMPONENTS && "Too many components, raise ECS_MAX_COMPONENTS");
+    ECSComponentInfo info = {
+        .name = name,
+        .size = size,
+    };
+    ecs_da_append(&ecs_components, info);
+    if(size == 0) ecs_mask_set(&ecs_tags, id);
+    return id;
+}
+
+size_t ecs_register_resource(const char *name, size_t size) {
+    ECS_ASSERT(size > 0 && "A resource needs a value");
+    size_t id = ecs_register_component(name, size);
+    ecs_mask_set(&ecs_resource_ids, id);
+    return id;
+}
+
+void* ecs_resource_get(ECSWorld *w, size_t resource) {
+    return resource < w->resources.count ? w->resources.items[resource] : NULL;
+}
+
+void* ecs_resource_set(ECSWorld *w, size_t resource, const void *value) {
+    ECS_ASSERT(resource < ecs_components.count && ecs_is_resource(resource) && "Resource is not registered");
+    size_t size = ecs_components.items[resource].size;
+    if(resource >= w->resources.count) {
+        ecs_da_reserve_with(w->allocator, &w->resources, resource + 1);
+        for(size_t r = w->resources.count; r <= resource; ++r) w->resources.items[r] = NULL;
+        w->resources.count = resource + 1;
+    }
+    void **slot = &w->resources.items[resource];
+    if(*slot == NULL) {
+        *slot = ecs_mem_alloc(w->allocator, size);
+        ECS_ASSERT(*slot != NULL && "Buy more RAM lol");
+    }
+    if(value != NULL) memcpy(*slot, value, size);
+    else memset(*slot, 0, size);
+    return *slot;
+}
+
+void ecs_resource_remove(ECSWorld *w, size_t resource) {
+    void *value = ecs_resource_get(w, resource);
+    if(value == NULL) return;
+    ecs_mem_free(w->allocator, value, ecs_components.items[resource].size);
+    w->resources.items[resource] = NULL;
+}
+
+void ecs_observe(ECSWorld *w, size_t component, ECSEvent event, ECSObserverFn fn, void *ctx) {
+    ECS_ASSERT(component < ecs_components.count && "Component is not registered");
+    ECSObserver observer = { .component = component, .event = event, .fn = fn, .ctx = ctx };
+    ecs_da_append_with(w->allocator, &w->observers, observer);
+    ecs_mask_set(&w->observed[event], component);
+}
+
+void ecs_unobserve(ECSWorld *w, size_t component, ECSEvent event, ECSObserverFn fn, void *ctx) {
+    bool observed = false;
+    for(size_t i = 0; i < w->observers.count;) {
+        ECSObserver *it = &w->observers.items[i];
+        if(it->component == component && it->event == event) {
+            if(it->fn == fn && it->ctx == ctx) {
+                memmove(it, it + 1, (w->observers.count - i - 1) * sizeof(*it));
+                w->observers.count--;
+                continue;
+            }
+            observed = true;
+        }
+        i++;
+    }
+    if(!observed) ecs_mask_clear(&w->observed[event], component);
+}
+
+static void ecs_emit(ECSWorld *w, size_t component, ECSEvent event, const ECSEntityId *ids, size_t count) {
+    if(count == 0 || !ecs_mask_test(&w->observed[event], component)) return;
+    for(size_t i = 0; i < w->observers.count; ++i) {
+        ECSObserver *it = &w->observers.items[i];
+        if(it->component == component && it->event == event) it->fn(w, component, ids, count, it->ctx);
+    }
+}
+
+// Collects the alive entities of `ids` that have `component` (or lack it, with `has` false)
+static size_t ecs_collect(ECSWorld *w, size_t component, bool has, const ECSEntityId *ids, size_t count, ECSEntityId *out) {
+    size_t n = 0;
+    for(size_t i = 0; i < count; ++i) {
+        ECSEntity *e = ecs_get_entity_with_id(w, ids[i]);
+        if(e != NULL && ecs_mask_test(&e->mask, component) == has) out[n++] = ids[i];
+    }
+    return n;
+}
+
+void* ecs_component_add(ECSWorld *w, ECSEntity *e, size_t component, const void *value) {
+    ECS_ASSERT(!ecs_is_resource(component) && "Resources live in the world, not on entities");
+    bool added = !ecs_mask_test(&e->mask, component);
+    void *dst = ecs_component_attach(w, e, component, value);
+    ECSEntityId id = e->id;
+    if(added) ecs_emit(w, component, ECS_ON_ADD, &id, 1);
+    ecs_emit(w, component, ECS_ON_SET, &id, 1);
+    return dst;
+}
+
+void ecs_component_remove(ECSWorld *w, ECSEntity *e, size_t component) {
+    if(!ecs_mask_test(&e->mask, component)) return;
+    ECSEntityId id = e->id;
+    ecs_emit(w, component, ECS_ON_REMOVE, &id, 1);
+    ecs_component_detach(w, e, component);
+}
+
+void ecs_component_add_bulk(ECSWorld *w, size_t component, const ECSEntityId *ids, const void *values, size_t count) {
+    ECS_ASSERT(!ecs_is_resource(component) && "Resources live in the world, not on entities");
+    if(!ecs_mask_test(&w->observed[ECS_ON_ADD], component)) {
+        ecs_component_attach_bulk(w, component, ids, values, count);
+        ecs_emit(w, component, ECS_ON_SET, ids, count);
+        return;
+    }
+    // the observer may start another bulk add, so the new entities get a buffer of their own
+    ECSEntityId *added = ecs_mem_alloc(w->allocator, count * sizeof(ECSEntityId));
+    ECS_ASSERT(added != NULL && "Buy more RAM lol");
+    size_t n = ecs_collect(w, component, false, ids, count, added);
+    ecs_component_attach_bulk(w, component, ids, values, count);
+    ecs_emit(w, component, ECS_ON_ADD, added, n);
+    ecs_emit(w, component, ECS_ON_SET, ids, count);
+    ecs_mem_free(w->allocator, added, count * sizeof(ECSEntityId));
+}
+
+// Removes `component` from every alive entity of `ids`, observers see all of them in one call
+static void ecs_component_remove_batch(ECSWorld *w, size_t component, const ECSEntityId *ids, size_t count) {
+    if(ecs_mask_test(&w->observed[ECS_ON_REMOVE], component) && count > 0) {
+        ECSEntityId *removed = ecs_mem_alloc(w->allocator, count * sizeof(ECSEntityId));
+        ECS_ASSERT(removed != NULL && "Buy more RAM lol");
+        ecs_emit(w, component, ECS_ON_REMOVE, removed, ecs_collect(w, component, true, ids, count, removed));
+        ecs_mem_free(w->allocator, removed, count * sizeof(ECSEntityId));
+    }
+    for(size_t i = 0; i < count; ++i) {
+        ECSEntity *e = ecs_get_entity_with_id(w, ids[i]);
+        if(e != NULL) ecs_component_detach(w, e, component);
+    }
+}
+
+void* ecs_component_get_mut(ECSWorld *w, ECSEntity *e, size_t component) {
+    if(!ecs_mask_test(&e->mask, component)) return NULL;
+    ecs_component_touch(w, e, component, false);
+    return ecs_component_get(w, e, component);
+}
+
+void ecs_component_set(ECSWorld *w, ECSEntity *e, size_t component, const void *value) {
+    ecs_component_add(w, e, component, value);
+}
+
+const uint32_t* ecs_component_ticks(ECSWorld *w, ECSEntity *e, size_t component) {
+    ECSTicks *ticks = ecs_component_ticks_of(w, e, component);
+    return ticks ? *ticks : NULL;
+}
+
+uint32_t ecs_world_tick(ECSWorld *w) {
+    return w->tick;
+}
+
+uint32_t ecs_world_advance_tick(ECSWorld *w) {
+    return ++w->tick;
+}
+
+ECSFilter ecs_filter_of(const size_t *terms, size_t count, uint32_t since) {
+    ECSFilter filter = { .since = since };
+    for(size_t i = 0; i < count; ++i) {
+        size_t c = terms[i] & ~(ECS_TERM_CHANGED | ECS_TERM_ADDED);
+        ECS_ASSERT(c < ECS_MAX_COMPONENTS && "Component is not registered");
+        ecs_mask_set(&filter.mask, c);
+        ECS_ASSERT(!((terms[i] & (ECS_TERM_CHANGED | ECS_TERM_ADDED)) && ecs_is_tag(c)) && "Tags have no ticks to filter on");
+        if(terms[i] & ECS_TERM_CHANGED) ecs_mask_set(&filter.changed, c);
+        if(terms[i] & ECS_TERM_ADDED) ecs_mask_set(&filter.added, c);
+    }
+    return filter;
+}
+
+static bool ecs_filter_match(ECSWorld *w, ECSEntity *e, const ECSFilter *f) {
+    if(!ecs_mask_contains(&e->mask, &f->mask)) return false;
+    for(size_t i = 0; i < ECS_MASK_WORDS; ++i) {
+        for(uint64_t bits = f->changed.words[i] | f->added.words[i]; bits != 0; bits &= bits - 1) {
+            size_t c = i * 64 + (size_t)__builtin_ctzll(bits);
+            ECSTicks *ticks = ecs_component_ticks_of(w, e, c);
+            if(ecs_mask_test(&f->changed, c) && (*ticks)[ECS_TICK_CHANGED] < f->since) return false;
+            if(ecs_mask_test(&f->added, c) && (*ticks)[ECS_TICK_ADDED] < f->since) return false;
+        }
+    }
+    return true;
+}
+
+#ifndef ECS_ARCHETYPES
+ECSSparseSet* ecs_world_storage(ECSWorld *w, size_t component) {
+    ECS_ASSERT(component < ecs_components.count && "Component is not registered");
+    if(component >= w->storages.count) {
+        ecs_da_reserve_with(w->allocator, &w->storages, component + 1);
+        for(size_t c = w->storages.count; c <= component; ++c) {
+            w->storages.items[c] = (ECSSparseSet){
+                .size = ecs_components.items[c].size,
+                .allocator = w->allocator,
+                .tracked = true,
+            };
+        }
+        w->storages.count = component + 1;
+    }
+    return &w->storages.items[component];
+}
+
+static void ecs_queries_update(ECSWorld *w, ECSEntity *e, ECSEntityMask old_mask) {
+    if(ecs_mask_equals(&e->mask, &old_mask)) return;
+    ecs_da_foreach(ECSQuery*, it, &w->queries) {
+        ECSQuery *q = *it;
+        bool was = ecs_mask_contains(&old_mask, &q->mask);
+        bool now = ecs_mask_contains(&e->mask, &q->mask);
+        if(was == now) continue;
+        if(now) ecs_sparse_insert(&q->matches, e->id, NULL);
+        else ecs_sparse_remove(&q->matches, e->id);
+    }
+}
+
+void* ecs_component_get(ECSWorld *w, ECSEntity *e, size_t component) {
+    if(component >= w->storages.count) return NULL;
+    return ecs_sparse_get(&w->storages.items[component], e->id);
+}
+
+static void ecs_sparse_touch(ECSSparseSet *set, size_t index, uint32_t tick, bool added) {
+    if(!set->tracked) return;
+    ECSTicks *block = &set->block_ticks[index / ECS_TICK_BLOCK];
+    if(added) {
+        set->ticks[index][ECS_TICK_ADDED] = tick;
+        if((*block)[ECS_TICK_ADDED] < tick) (*block)[ECS_TICK_ADDED] = tick;
+    }
+    set->ticks[index][ECS_TICK_CHANGED] = tick;
+    if((*block)[ECS_TICK_CHANGED] < tick) (*block)[ECS_TICK_CHANGED] = tick;
+}
+
+static ECSTicks* ecs_component_ticks_of(ECSWorld *w, ECSEntity *e, size_t component) {
+    if(!ecs_mask_test(&e->mask, component) || ecs_is_tag(component)) return NULL;
+    ECSSparseSet *set = &w->storages.items[component];
+    return &set->ticks[*ecs_sparse_slot(set, e->id, false)];
+}
+
+static void ecs_component_touch(ECSWorld *w, ECSEntity *e, size_t component, bool added) {
+    if(ecs_is_tag(component)) return;
+    ECSSparseSet *set = &w->storages.items[component];
+    ecs_sparse_touch(set, *ecs_sparse_slot(set, e->id, false), w->tick, added);
+}
+
+static void* ecs_component_attach(ECSWorld *w, ECSEntity *e, size_t component, const void *value) {
+    bool added = !ecs_mask_test(&e->mask, component);
+    ECSEntityMask old_mask = e->mask;
+    ecs_mask_set(&e->mask, component);
+    ecs_queries_update(w, e, old_mask);
+    if(ecs_is_tag(component)) return NULL;
+    void *dst = ecs_sparse_insert(ecs_world_storage(w, component), e->id, value);
+    ecs_component_touch(w, e, component, added);
+    return dst;
+}
+
+static void ecs_component_detach(ECSWorld *w, ECSEntity *e, size_t component) {
+    if(!ecs_mask_test(&e->mask, component)) return;
+    ECSEntityMask old_mask = e->mask;
+    ecs_mask_clear(&e->mask, component);
+    ecs_queries_update(w, e, old_mask);
+    if(!ecs_is_tag(component)) ecs_sparse_remove(&w->storages.items[component], e->id);
+}
+
+static void ecs_component_attach_bulk(ECSWorld *w, size_t component, const ECSEntityId *ids, const void *values, size_t count) {
+    if(ecs_is_tag(component)) {
+        for(size_t i = 0; i < count; ++i) {
+            ECSEntity *e = ecs_get_entity_with_id(w, ids[i]);
+            ECS_ASSERT(e != NULL && "Entity is not alive");
+            ECSEntityMask old_mask = e->mask;
+            ecs_mask_set(&e->mask, component);
+            ecs_queries_update(w, e, old_mask);
+        }
+        return;
+    }
+    ECSSparseSet *set = ecs_world_storage(w, component);
+    const unsigned char *src = values;
+    size_t first = set->dense.count;
+    ecs_sparse_reserve(set, first + count);
+    // as long as every entity is new the values land back to back and get copied in one go
+    bool packed = true;
+    for(size_t i = 0; i < count; ++i) {
+        ECSEntity *e = ecs_get_entity_with_id(w, ids[i]);
+        ECS_ASSERT(e != NULL && "Entity is not alive");
+        ECSEntityMask old_mask = e->mask;
+        ecs_mask_set(&e->mask, component);
+        ecs_queries_update(w, e, old_mask);
+        size_t *slot = ecs_sparse_slot(set, ids[i], true);
+        ecs_sparse_touch(set, *slot == ECS_SPARSE_NONE ? set->dense.count : *slot, w->tick, !ecs_mask_test(&old_mask, component));
+        if(*slot == ECS_SPARSE_NONE) {
+            *slot = set->dense.count;
+            set->dense.items[set->dense.count++] = ids[i];
+            if(packed) continue;
+        } else {
+            set->dense.items[*slot] = ids[i];
+            if(packed && set->size > 0) memcpy(set->data + first * set->size, src, i * set->size);
+            packed = false;
+        }
+        if(set->size > 0) memcpy(set->data + *slot * set->size, src + i * set->size, set->size);
+    }
+    if(packed && set->size > 0) memcpy(set->data + first * set->size, src, count * set->size);
+}
+
+ECSFilterIter ecs_filter_iter(ECSWorld *w, ECSFilter filter) {
+    ECSFilterIter it = {
+        .world = w,
+        .filter = filter,
+        .driver = ECS_NO_COMPONENT,
+        .term = ECS_NO_COMPONENT,
+        .block = ECS_NO_COMPONENT,
+        .keep = true,
+    };
+    // walk the storage of a changed/added term so whole blocks can be skipped by their ticks
+    for(size_t i = 0; i < ECS_MASK_WORDS && it.driver == ECS_NO_COMPONENT; ++i) {
+        uint64_t changed = filter.changed.words[i], added = filter.added.words[i];
+        if(changed | added) {
+            it.driver = i * 64 + (size_t)__builtin_ctzll(changed | added);
+            it.term = ecs_mask_test(&filter.changed, it.driver) ? ECS_TICK_CHANGED : ECS_TICK_ADDED;
+        }
+    }
+    for(size_t i = 0; i < ECS_MASK_WORDS && it.driver == ECS_NO_COMPONENT; ++i) {
+        uint64_t stored = filter.mask.words[i] & ~ecs_tags.words[i];
+        if(stored) it.driver = i * 64 + (size_t)__builtin_ctzll(stored);
+    }
+    // only tags: nothing is stored for them, so the entity table is walked instead
+    if(it.driver != ECS_NO_COMPONENT) it.index = ecs_world_storage(w, it.driver)->dense.count;
+    else if(!ecs_mask_is_empty(&filter.mask)) it.index = w->entities.count;
+    return it;
+}
+
+// Rows are walked from the back, like QueryCached, so despawning the current entity is fine
+bool ecs_filter_iter_next(ECSFilterIter *it) {
+    ECSWorld *w = it->world;
+    if(it->driver == ECS_NO_COMPONENT) {
+        if(it->index > w->entities.count) it->index = w->entities.count;
+        while(it->index > 0) {
+            ECSEntity *e = &w->entities.items[--it->index];
+            ecs_profile_count(visited, 1);
+            if(ecs_mask_contains(&e->mask, &it->filter.mask)) {
+                ecs_profile_count(matched, 1);
+                it->entity = e;
+                return true;
+            }
+        }
+        return false;
+    }
+    ECSSparseSet *set = &w->storages.items[it->driver];
+    if(it->index > set->dense.count) it->index = set->dense.count;
+    while(it->index > 0) {
+        size_t index = it->index - 1;
+        if(it->term != ECS_NO_COMPONENT && index / ECS_TICK_BLOCK != it->block) {
+            it->block = index / ECS_TICK_BLOCK;
+            if(set->block_ticks[it->block][it->term] < it->filter.since) {
+                it->index = it->block * ECS_TICK_BLOCK;
+                continue;
+            }
+        }
+        it->index = index;
+        ecs_profile_count(visited, 1);
+        ECSEntity *e = &w->entities.items[ecs_entity_index(set->dense.items[index])];
+        if(ecs_filter_match(w, e, &it->filter)) {
+            ecs_profile_count(matched, 1);
+            it->entity = e;
+            return true;
+        }
+    }
+    return false;
+}
+
+ECSQuery* ecs_query_create(ECSWorld *w, ECSEntityMask mask) {
+    ECS_ASSERT(!ecs_mask_is_empty(&mask) && "A query needs at least one component");
+    ecs_da_foreach(ECSQuery*, it, &w->queries) {
+        if(ecs_mask_equals(&(*it)->mask, &mask)) {
+            (*it)->refs++;
+            return *it;
+        }
+    }
+    ECSQuery *q = ecs_mem_alloc(w->allocator, sizeof(ECSQuery));
+    ECS_ASSERT(q != NULL && "Buy more RAM lol");
+    *q = (ECSQuery){ .world = w, .mask = mask, .refs = 1 };
+    q->matches.allocator = w->allocator;
+    QueryByComponentMask(w, e, mask) {
+        ecs_sparse_insert(&q->matches, e->id, NULL);
+    }
+    ecs_da_append_with(w->allocator, &w->queries, q);
+    return q;
+}
+
+static void ecs_query_free(ECSQuery *q) {
+    ecs_sparse_free(&q->matches);
+    ecs_mem_free(q->world->allocator, q, sizeof(ECSQuery));
+}
+
+size_t ecs_query_count(ECSQuery *q) {
+    return q->matches.dense.count;
+}
+
+ECSQueryIter ecs_query_iter(ECSQuery *q) {
+    return (ECSQueryIter){
+        .query = q,
+        .index = q->matches.dense.count,
+        .keep = true,
+    };
+}
+
+bool ecs_query_iter_next(ECSQueryIter *it) {
+    // a swap-remove of the current entity pulls an already visited one into its slot
+    if(it->index > it->query->matches.dense.count) it->index = it->query->matches.dense.count;
+    if(it->index == 0) return false;
+    it->index--;
+    ecs_profile_count(visited, 1);
+    ecs_profile_count(matched, 1);
+    it->entity = &it->query->world->entities.items[ecs_entity_index(it->query->matches.dense.items[it->index])];
+    return true;
+}
+#else
+static size_t ecs_mask_hash(const ECSEntityMask *mask) {
+    uint64_t h = 0;
+    for(size_t i = 0; i < ECS_MASK_WORDS; ++i) h = (h ^ mask->words[i]) * 0x9E3779B97F4A7C15ull;
+    return (size_t)(h ^ (h >> 29));
+}
+
+// Slot of `mask` in the archetype table, either holding its archetype or the free one to put it in
+static size_t* ecs_archetype_slot(ECSWorld *w, const ECSEntityMask *mask) {
+    size_t bits = w->archetype_slot_capacity - 1;
+    for(size_t i = ecs_mask_hash(mask) & bits;; i = (i + 1) & bits) {
+        size_t *slot = &w->archetype_slots[i];
+        if(*slot == 0 || ecs_mask_equals(&w->archetypes.items[*slot - 1].mask, mask)) return slot;
+    }
+}
+
+static void ecs_archetype_rehash(ECSWorld *w, size_t capacity) {
+    ecs_mem_free(w->allocator, w->archetype_slots, w->archetype_slot_capacity * sizeof(size_t));
+    w->archetype_slots = ecs_mem_alloc(w->allocator, capacity * sizeof(size_t));
+    ECS_ASSERT(w->archetype_slots != NULL && "Buy more RAM lol");
+    memset(w->archetype_slots, 0, capacity * sizeof(size_t));
+    w->archetype_slot_capacity = capacity;
+    for(size_t i = 0; i < w->archetypes.count; ++i) *ecs_archetype_slot(w, &w->archetypes.items[i].mask) = i + 1;
+}
+
+static size_t ecs_archetype_find(ECSWorld *w, ECSEntityMask mask) {
+    if((w->archetypes.count + 1) * 2 > w->archetype_slot_capacity) {
+        ecs_archetype_rehash(w, w->archetype_slot_capacity ? w->archetype_slot_capacity * 2 : 64);
+    }
+    size_t *slot = ecs_archetype_slot(w, &mask);
+    if(*slot != 0) return *slot - 1;
+    ECSArchetype a = {
+        .mask = mask,
+        .columns = mask,
+    };
+    for(size_t i = 0; i < ECS_MASK_WORDS; ++i) a.columns.words[i] &= ~ecs_tags.words[i];
+    a.component_count = ecs_mask_count(&a.columns);
+    a.components = ecs_mem_alloc(w->allocator, (a.component_count + 1) * sizeof(size_t));
+    a.offsets = ecs_mem_alloc(w->allocator, (a.component_count + 1) * sizeof(size_t));
+    a.tick_offsets = ecs_mem_alloc(w->allocator, (a.component_count + 1) * sizeof(size_t));
+    ECS_ASSERT(a.components != NULL && a.offsets != NULL && a.tick_offsets != NULL && "Buy more RAM lol");
+    size_t row_size = sizeof(ECSEntityId);
+    for(size_t c = 0, col = 0; col < a.component_count; ++c) {
+        if(!ecs_mask_test(&a.columns, c)) continue;
+        a.components[col++] = c;
+        row_size += ecs_components.items[c].size + sizeof(ECSTicks);
+    }
+    // leave room for aligning every column and for the chunk ticks, a row that doesn't fit still
+    // gets a chunk of its own
+    size_t padding = a.component_count * (ECS_CHUNK_COLUMN_ALIGN + sizeof(ECSTicks)) + sizeof(ECSTicks);
+    a.chunk_capacity = padding < ECS_CHUNK_SIZE ? (ECS_CHUNK_SIZE - padding) / row_size : 0;
+    if(a.chunk_capacity == 0) a.chunk_capacity = 1;
+    size_t offset = a.chunk_capacity * sizeof(ECSEntityId);
+    for(size_t col = 0; col < a.component_count; ++col) {
+        offset = (offset + ECS_CHUNK_COLUMN_ALIGN - 1) & ~(size_t)(ECS_CHUNK_COLUMN_ALIGN - 1);
+        a.offsets[col] = offset;
+        offset += a.chunk_capacity * ecs_components.items[a.components[col]].size;
+    }
+    a.offsets[a.component_count] = offset;
+    offset = (offset + sizeof(uint32_t) - 1) & ~(size_t)(sizeof(uint32_t) - 1);
+    for(size_t col = 0; col <= a.component_count; ++col) {
+        a.tick_offsets[col] = offset;
+        offset += a.chunk_capacity * sizeof(ECSTicks);
+    }
+    offset = a.tick_offsets[a.component_count] + a.component_count * sizeof(ECSTicks);
+    a.chunk_size = offset < ECS_CHUNK_SIZE ? ECS_CHUNK_SIZE : offset;
+    ecs_da_append_with(w->allocator, &w->archetypes, a);
+    *slot = w->archetypes.count;
+    ecs_da_foreach(ECSQuery*, it, &w->queries) {
+        if(ecs_mask_contains(&mask, &(*it)->mask)) ecs_da_append_with(w->allocator, &(*it)->archetypes, w->archetypes.count - 1);
+    }
+    return w->archetypes.count - 1;
+}
+
+// Where spawned entities start out
+static size_t ecs_archetype_root(ECSWorld *w) {
+    if(w->root_archetype == 0) w->root_archetype = ecs_archetype_find(w, (ECSEntityMask){0}) + 1;
+    return w->root_archetype - 1;
+}
+
+static size_t ecs_archetype_column(ECSArchetype *a, size_t component) {
+    return ecs_mask_count_below(&a->columns, component);
+}
+
+static void* ecs_archetype_cell(ECSArchetype *a, size_t col, size_t row) {
+    unsigned char *chunk = a->chunks.items[row / a->chunk_capacity];
+    return chunk + a->offsets[col] + (row % a->chunk_capacity) * ecs_components.items[a->components[col]].size;
+}
+
+static ECSEntityId* ecs_archetype_entity(ECSArchetype *a, size_t row) {
+    return &((ECSEntityId*)a->chunks.items[row / a->chunk_capacity])[row % a->chunk_capacity];
+}
+
+static ECSTicks* ecs_archetype_ticks(ECSArchetype *a, size_t col, size_t row) {
+    unsigned char *chunk = a->chunks.items[row / a->chunk_capacity];
+    return (ECSTicks*)(chunk + a->tick_offsets[col]) + row % a->chunk_capacity;
+}
+
+// Newest ticks of column `col` in chunk `chunk`
+static ECSTicks* ecs_archetype_chunk_ticks(ECSArchetype *a, size_t col, size_t chunk) {
+    return (ECSTicks*)(a->chunks.items[chunk] + a->tick_offsets[a->component_count]) + col;
+}
+
+static void ecs_archetype_set_ticks(ECSArchetype *a, size_t col, size_t row, const ECSTicks ticks) {
+    ECSTicks *cell = ecs_archetype_ticks(a, col, row);
+    ECSTicks *newest = ecs_archetype_chunk_ticks(a, col, row / a->chunk_capacity);
+    for(size_t k = 0; k < 2; ++k) {
+        (*cell)[k] = ticks[k];
+        if((*newest)[k] < ticks[k]) (*newest)[k] = ticks[k];
+    }
+}
+
+// The byte before an aligned chunk holds how far into its block it starts
+static unsigned char* ecs_chunk_alloc(ECSWorld *w, size_t size) {
+    unsigned char *block = ecs_mem_alloc(w->chunk_allocator, size + ECS_CHUNK_COLUMN_ALIGN);
+    ECS_ASSERT(block != NULL && "Buy more RAM lol");
+    size_t skip = ECS_CHUNK_COLUMN_ALIGN - (uintptr_t)block % ECS_CHUNK_COLUMN_ALIGN;
+    block[skip - 1] = (unsigned char)(skip - 1);
+    return block + skip;
+}
+
+static void ecs_chunk_free(ECSWorld *w, unsigned char *chunk, size_t size) {
+    ecs_mem_free(w->chunk_allocator, chunk - 1 - chunk[-1], size + ECS_CHUNK_COLUMN_ALIGN);
+}
+
+static unsigned char* ecs_archetype_new_chunk(ECSWorld *w, ECSArchetype *a) {
+    unsigned char *chunk = ecs_chunk_alloc(w, a->chunk_size);
+    memset(chunk + a->tick_offsets[a->component_count], 0, a->component_count * sizeof(ECSTicks));
+    return chunk;
+}
+
+static void ecs_archetype_reserve(ECSWorld *w, size_t archetype, size_t count) {
+    ECSArchetype *a = &w->archetypes.items[archetype];
+    size_t chunks = (count + a->chunk_capacity - 1) / a->chunk_capacity;
+    ecs_da_reserve_with(w->allocator, &a->chunks, chunks);
+    while(a->chunks.count < chunks) {
+        a->chunks.items[a->chunks.count++] = ecs_archetype_new_chunk(w, a);
+    }
+}
+
+static size_t ecs_archetype_push(ECSWorld *w, size_t archetype, ECSEntityId id) {
+    ECSArchetype *a = &w->archetypes.items[archetype];
+    if(a->count == a->chunks.count * a->chunk_capacity) {
+        unsigned char *chunk = ecs_archetype_new_chunk(w, a);
+        ecs_da_append_with(w->allocator, &a->chunks, chunk);
+    }
+    size_t row = a->count++;
+    *ecs_archetype_entity(a, row) = id;
+    return row;
+}
+
+// Swap-removes `row`, the entity that used to be last takes its place
+static void ecs_archetype_pop(ECSWorld *w, size_t archetype, size_t row) {
+    ECSArchetype *a = &w->archetypes.items[archetype];
+    size_t last = a->count - 1;
+    if(row != last) {
+        ECSEntityId moved = *ecs_archetype_entity(a, last);
+        *ecs_archetype_entity(a, row) = moved;
+        for(size_t col = 0; col < a->component_count; ++col) {
+            memcpy(ecs_archetype_cell(a, col, row), ecs_archetype_cell(a, col, last), ecs_components.items[a->components[col]].size);
+            ecs_archetype_set_ticks(a, col, row, *ecs_archetype_ticks(a, col, last));
+        }
+        w->entities.items[ecs_entity_index(moved)].row = row;
+    }
+    a->count--;
+    // keep one spare chunk around so an entity bouncing on a chunk boundary doesn't thrash the allocator
+    if(a->chunks.count * a->chunk_capacity >= a->count + 2 * a->chunk_capacity) {
+        ecs_chunk_free(w, a->chunks.items[--a->chunks.count], a->chunk_size);
+    }
+}
+
+static size_t ecs_archetype_edge(ECSWorld *w, size_t archetype, size_t component, bool add) {
+    ECSArchetype *a = &w->archetypes.items[archetype];
+    ECSArchetypeEdge *edge = NULL;
+    ecs_da_foreach(ECSArchetypeEdge, it, &a->edges) {
+        if(it->component == component) { edge = it; break; }
+    }
+    if(edge == NULL) {
+        ECSArchetypeEdge new_edge = {component, ECS_NO_ARCHETYPE, ECS_NO_ARCHETYPE};
+        ecs_da_append_with(w->allocator, &a->edges, new_edge);
+        edge = &ecs_da_last(&a->edges);
+    }
+    size_t *target = add ? &edge->add : &edge->remove;
+    if(*target == ECS_NO_ARCHETYPE) {
+        ECSEntityMask mask = a->mask;
+        if(add) ecs_mask_set(&mask, component);
+        else ecs_mask_clear(&mask, component);
+        // ecs_archetype_find may grow `w->archetypes`, so `edge` is looked up again afterwards
+        size_t found = ecs_archetype_find(w, mask);
+        size_t index = edge - w->archetypes.items[archetype].edges.items;
+        edge = &w->archetypes.items[archetype].edges.items[index];
+        target = add ? &edge->add : &edge->remove;
+        *target = found;
+    }
+    return *target;
+}
+
+static void ecs_archetype_move(ECSWorld *w, ECSEntity *e, size_t target) {
+    size_t row = ecs_archetype_push(w, target, e->id);
+    ECSArchetype *src = &w->archetypes.items[e->archetype];
+    ECSArchetype *dst = &w->archetypes.items[target];
+    for(size_t col = 0; col < dst->component_count; ++col) {
+        size_t c = dst->components[col];
+        if(!ecs_mask_test(&src->mask, c)) continue;
+        size_t src_col = ecs_archetype_column(src, c);
+        memcpy(ecs_archetype_cell(dst, col, row), ecs_archetype_cell(src, src_col, e->row), ecs_components.items[c].size);
+        ecs_archetype_set_ticks(dst, col, row, *ecs_archetype_ticks(src, src_col, e->row));
+    }
+    ecs_archetype_pop(w, e->archetype, e->row);
+    e->archetype = target;
+    e->row = row;
+    e->mask = dst->mask;
+}
+
+void* ecs_component_get(ECSWorld *w, ECSEntity *e, size_t component) {
+    if(!ecs_mask_test(&e->mask, component) || ecs_is_tag(component)) return NULL;
+    ECSArchetype *a = &w->archetypes.items[e->archetype];
+    return ecs_archetype_cell(a, ecs_archetype_column(a, component), e->row);
+}
+
+static ECSTicks* ecs_component_ticks_of(ECSWorld *w, ECSEntity *e, size_t component) {
+    if(!ecs_mask_test(&e->mask, component) || ecs_is_tag(component)) return NULL;
+    ECSArchetype *a = &w->archetypes.items[e->archetype];
+    return ecs_archetype_ticks(a, ecs_archetype_column(a, component), e->row);
+}
+
+static void ecs_component_touch(ECSWorld *w, ECSEntity *e, size_t component, bool added) {
+    if(ecs_is_tag(component)) return;
+    ECSArchetype *a = &w->archetypes.items[e->archetype];
+    size_t col = ecs_archetype_column(a, component);
+    ECSTicks ticks = { (*ecs_archetype_ticks(a, col, e->row))[ECS_TICK_ADDED], w->tick };
+    if(added) ticks[ECS_TICK_ADDED] = w->tick;
+    ecs_archetype_set_ticks(a, col, e->row, ticks);
+}
+
+static void* ecs_component_attach(ECSWorld *w, ECSEntity *e, size_t component, const void *value) {
+    bool added = !ecs_mask_test(&e->mask, component);
+    if(added) {
+        ecs_archetype_move(w, e, ecs_archetype_edge(w, e->archetype, component, true));
+    }
+    // a tag still moves the entity to another archetype, but there is no cell to write
+    if(ecs_is_tag(component)) return NULL;
+    void *dst = ecs_component_get(w, e, component);
+    memcpy(dst, value, ecs_components.items[component].size);
+    ecs_component_touch(w, e, component, added);
+    return dst;
+}
+
+static void ecs_component_detach(ECSWorld *w, ECSEntity *e, size_t component) {
+    if(!ecs_mask_test(&e->mask, component)) return;
+    ecs_archetype_move(w, e, ecs_archetype_edge(w, e->archetype, component, false));
+}
+
+static void ecs_component_attach_bulk(ECSWorld *w, size_t component, const ECSEntityId *ids, const void *values, size_t count) {
+    const unsigned char *src = values;
+    size_t size = ecs_components.items[component].size;
+    // entities loaded together usually share an archetype, so the last transition is reused
+    size_t from = ECS_NO_ARCHETYPE, to = ECS_NO_ARCHETYPE;
+    for(size_t i = 0; i < count; ++i) {
+        ECSEntity *e = ecs_get_entity_with_id(w, ids[i]);
+        ECS_ASSERT(e != NULL && "Entity is not alive");
+        bool added = !ecs_mask_test(&e->mask, component);
+        if(added) {
+            if(e->archetype != from) {
+                from = e->archetype;
+                to = ecs_archetype_edge(w, from, component, true);
+                ecs_archetype_reserve(w, to, w->archetypes.items[to].count + count - i);
+            }
+            ecs_archetype_move(w, e, to);
+        }
+        if(size == 0) continue;
+        memcpy(ecs_component_get(w, e, component), src + i * size, size);
+        ecs_component_touch(w, e, component, added);
+    }
+}
+
+ECSFilterIter ecs_filter_iter(ECSWorld *w, ECSFilter filter) {
+    return (ECSFilterIter){
+        .world = w,
+        .filter = filter,
+        .chunk = ecs_chunk_iter(w, filter.mask),
+        .keep = true,
+    };
+}
+
+// A chunk can only hold a match when the newest ticks of every filtered column are recent enough
+static bool ecs_filter_chunk(ECSArchetype *a, size_t chunk, const ECSFilter *f) {
+    for(size_t col = 0; col < a->component_count; ++col) {
+        size_t c = a->components[col];
+        ECSTicks *newest = ecs_archetype_chunk_ticks(a, col, chunk);
+        if(ecs_mask_test(&f->changed, c) && (*newest)[ECS_TICK_CHANGED] < f->since) return false;
+        if(ecs_mask_test(&f->added, c) && (*newest)[ECS_TICK_ADDED] < f->since) return false;
+    }
+    return true;
+}
+
+bool ecs_filter_iter_next(ECSFilterIter *it) {
+    ECSWorld *w = it->world;
+    bool filtered = !ecs_mask_is_empty(&it->filter.changed) || !ecs_mask_is_empty(&it->filter.added);
+    for(;;) {
+        if(it->chunk.entities != NULL) {
+            ECSArchetype *a = &w->archetypes.items[it->chunk.archetype];
+            size_t first = it->chunk.chunk * a->chunk_capacity;
+            size_t rows = a->count > first ? a->count - first : 0;
+            if(it->row > rows) it->row = rows;
+            while(it->row > 0) {
+                it->row--;
+                ECSEntity *e = &w->entities.items[ecs_entity_index(it->chunk.entities[it->row])];
+                if(!filtered || ecs_filter_match(w, e, &it->filter)) {
+                    ecs_profile_count(matched, 1);
+                    it->entity = e;
+                    return true;
+                }
+            }
+        }
+        if(!ecs_chunk_iter_step(&it->chunk)) return false;
+        it->row = it->chunk.count;
+        if(filtered && !ecs_filter_chunk(&w->archetypes.items[it->chunk.archetype], it->chunk.chunk, &it->filter)) it->row = 0;
+        ecs_profile_count(visited, it->row);
+    }
+}
+
+ECSChunkIter ecs_chunk_iter(ECSWorld *w, ECSEntityMask mask) {
+    return (ECSChunkIter){
+        .world = w,
+        .mask = mask,
+        .chunk = ECS_NO_ARCHETYPE,
+    };
+}
+
+// Chunks and rows are visited from the back, so when the current row gets swap-removed
+// it is refilled by one that was already visited
+static bool ecs_chunk_iter_step(ECSChunkIter *it) {
+    ECSWorld *w = it->world;
+    size_t count = it->query ? it->query->archetypes.count : w->archetypes.count;
+    for(; it->cursor < count; it->cursor++, it->chunk = ECS_NO_ARCHETYPE) {
+        it->archetype = it->query ? it->query->archetypes.items[it->cursor] : it->cursor;
+        ECSArchetype *a = &w->archetypes.items[it->archetype];
+        if(!ecs_mask_contains(&a->mask, &it->mask)) continue;
+        size_t chunks = (a->count + a->chunk_capacity - 1) / a->chunk_capacity;
+        if(it->chunk == ECS_NO_ARCHETYPE || it->chunk > chunks) it->chunk = chunks;
+        if(it->chunk == 0) continue;
+        it->chunk--;
+        size_t first = it->chunk * a->chunk_capacity;
+        it->count = a->count - first < a->chunk_capacity ? a->count - first : a->chunk_capacity;
+        it->entities = (ECSEntityId*)a->chunks.items[it->chunk];
+        return true;
+    }
+    return false;
+}
+
+// QueryChunks bodies get whole chunks, the entity and filter iterators count their rows themselves
+bool ecs_chunk_iter_next(ECSChunkIter *it) {
+    if(!ecs_chunk_iter_step(it)) return false;
+    ecs_profile_count(visited, it->count);
+    ecs_profile_count(matched, it->count);
+    return true;
+}
+
+void* ecs_chunk_column(ECSChunkIter *it, size_t component) {
+    ECSArchetype *a = &it->world->archetypes.items[it->archetype];
+    ECS_ASSERT(ecs_mask_test(&a->columns, component) && "Component is not part of the query, or is a tag");
+    return a->chunks.items[it->chunk] + a->offsets[ecs_archetype_column(a, component)];
+}
+
+ECSEntityIter ecs_entity_iter(ECSWorld *w, ECSEntityMask mask) {
+    return (ECSEntityIter){
+        .chunk = ecs_chunk_iter(w, mask),
+        .keep = true,
+    };
+}
+
+ECSQuery* ecs_query_create(ECSWorld *w, ECSEntityMask mask) {
+    ECS_ASSERT(!ecs_mask_is_empty(&mask) && "A query needs at least one component");
+    ecs_da_foreach(ECSQuery*, it, &w->queries) {
+        if(ecs_mask_equals(&(*it)->mask, &mask)) {
+            (*it)->refs++;
+            return *it;
+        }
+    }
+    ECSQuery *q = ecs_mem_alloc(w->allocator, sizeof(ECSQuery));
+    ECS_ASSERT(q != NULL && "Buy more RAM lol");
+    *q = (ECSQuery){ .world = w, .mask = mask, .refs = 1 };
+    for(size_t i = 0; i < w->archetypes.count; ++i) {
+        if(ecs_mask_contains(&w->archetypes.items[i].mask, &mask)) ecs_da_append_with(w->allocator, &q->archetypes, i);
+    }
+    ecs_da_append_with(w->allocator, &w->queries, q);
+    return q;
+}
+
+static void ecs_query_free(ECSQuery *q) {
+    ecs_da_free_with(q->world->allocator, &q->archetypes);
+    ecs_mem_free(q->world->allocator, q, sizeof(ECSQuery));
+}
+
+size_t ecs_query_count(ECSQuery *q) {
+    size_t count = 0;
+    ecs_da_foreach(size_t, it, &q->archetypes) {
+        count += q->world->archetypes.items[*it].count;
+    }
+    return count;
+}
+
+ECSChunkIter ecs_query_chunk_iter(ECSQuery *q) {
+    ECSChunkIter it = ecs_chunk_iter(q->world, q->mask);
+    it.query = q;
+    return it;
+}
+
+ECSEntityIter ecs_query_entity_iter(ECSQuery *q) {
+    return (ECSEntityIter){
+        .chunk = ecs_query_chunk_iter(q),
+        .keep = true,
+    };
+}
+
+bool ecs_entity_iter_next(ECSEntityIter *it) {
+    ECSWorld *w = it->chunk.world;
+    for(;;) {
+        if(it->chunk.entities != NULL) {
+            ECSArchetype *a = &w->archetypes.items[it->chunk.archetype];
+            size_t first = it->chunk.chunk * a->chunk_capacity;
+            size_t rows = a->count > first ? a->count - first : 0;
+            if(it->row > rows) it->row = rows;
+            if(it->row > 0) {
+                it->row--;
+                ecs_profile_count(matched, 1);
+                it->entity = &w->entities.items[ecs_entity_index(it->chunk.entities[it->row])];
+                return true;
+            }
+        }
+        if(!ecs_chunk_iter_step(&it->chunk)) return false;
+        it->row = it->chunk.count;
+        ecs_profile_count(visited, it->row);
+    }
+}
+#endif // ECS_ARCHETYPES
+
+void ecs_query_destroy(ECSQuery *q) {
+    ECS_ASSERT(q->refs > 0);
+    if(--q->refs > 0) return;
+    ECSWorld *w = q->world;
+    for(size_t i = 0; i < w->queries.count; ++i) {
+        if(w->queries.items[i] == q) {
+            ecs_da_remove_unordered(&w->queries, i);
+            break;
+        }
+    }
+    ecs_query_free(q);
+}
+
+void ecs_deinit(ECSWorld *w) {
+    ecs_da_free_with(w->allocator, &w->entities);
+    ecs_da_free_with(w->allocator, &w->dead_entities);
+    ecs_da_free_with(w->allocator, &w->observers);
+    ecs_da_free_with(w->allocator, &w->hierarchy.nodes);
+    ecs_da_free_with(w->allocator, &w->hierarchy.order);
+    ecs_da_free_with(w->allocator, &w->hierarchy.dirty);
+    ecs_da_free_with(w->allocator, &w->hierarchy.visits);
+    for(size_t r = 0; r < w->resources.count; ++r) ecs_resource_remove(w, r);
+    ecs_da_free_with(w->allocator, &w->resources);
+#ifndef ECS_ARCHETYPES
+    ecs_da_foreach(ECSSparseSet, it, &w->storages) {
+        ecs_sparse_free(it);
+    }
+    ecs_da_free_with(w->allocator, &w->storages);
+    ecs_snapshot_release(w, w->snapshot, w->snapshot_size);
+#else
+    ecs_da_foreach(ECSArchetype, a, &w->archetypes) {
+        ecs_da_foreach(unsigned char*, chunk, &a->chunks) {
+            ecs_chunk_free(w, *chunk, a->chunk_size);
+        }
+        ecs_da_free_with(w->allocator, &a->chunks);
+        ecs_da_free_with(w->allocator, &a->edges);
+        ecs_mem_free(w->allocator, a->components, (a->component_count + 1) * sizeof(size_t));
+        ecs_mem_free(w->allocator, a->offsets, (a->component_count + 1) * sizeof(size_t));
+        ecs_mem_free(w->allocator, a->tick_offsets, (a->component_count + 1) * sizeof(size_t));
+    }
+    ecs_da_free_with(w->allocator, &w->archetypes);
+    ecs_mem_free(w->allocator, w->archetype_slots, w->archetype_slot_capacity * sizeof(size_t));
+#endif
+    ecs_da_foreach(ECSQuery*, it, &w->queries) {
+        ecs_query_free(*it);
+    }
+    ecs_da_free_with(w->allocator, &w->queries);
+    // the world stays usable, and keeps the allocators it was set up with
+    *w = (ECSWorld){
+        .allocator = w->allocator,
+#ifdef ECS_ARCHETYPES
+        .chunk_allocator = w->chunk_allocator,
+#endif
+    };
+}
+
+typedef struct {
+    ECSWorld *world;
+    ECSEntityMask mask;
+    ECSParEachFn fn;
+    void *ctx;
+    const size_t *tasks;
+    const char *zone; // what the tasks are recorded as with ECS_PROFILE
+} ECSParEach;
+
+static void ecs_par_each_task(void *data, size_t task) {
+    ECSParEach *job = data;
+    ECSWorld *w = job->world;
+#ifdef ECS_PROFILE
+    ECSProfileZone zone = ecs_profile_begin(w, job->zone);
+    zone.task = true;
+#endif
+#ifdef ECS_ARCHETYPES
+    ECSArchetype *a = &w->archetypes.items[job->tasks[task * 2]];
+    size_t chunk = job->tasks[task * 2 + 1];
+    size_t first = chunk * a->chunk_capacity;
+    size_t rows = a->count - first < a->chunk_capacity ? a->count - first : a->chunk_capacity;
+    ECSEntityId *ids = (ECSEntityId*)a->chunks.items[chunk];
+    ecs_profile_count(visited, rows);
+    ecs_profile_count(matched, rows);
+    for(size_t row = 0; row < rows; ++row) {
+        job->fn(w, &w->entities.items[ecs_entity_index(ids[row])], job->ctx);
+    }
+#else
+    size_t begin = task * ECS_PAR_GRAIN;
+    size_t end = begin + ECS_PAR_GRAIN < w->entities.count ? begin + ECS_PAR_GRAIN : w->entities.count;
+    uint32_t matches[ECS_SCAN_BATCH];
+    for(size_t base = begin; base < end; base += ECS_SCAN_BATCH) {
+        size_t n = end - base < ECS_SCAN_BATCH ? end - base : ECS_SCAN_BATCH;
+        size_t count = ecs_mask_filter(&w->entities.items[base], n, &job->mask, matches);
+        ecs_profile_count(visited, n);
+        ecs_profile_count(matched, count);
+        for(size_t i = 0; i < count; ++i) job->fn(w, &w->entities.items[base + matches[i]], job->ctx);
+    }
+#endif
+#ifdef ECS_PROFILE
+    ecs_profile_end(&zone);
+#endif
+}
+
+// Fills `tasks` with the archetype and chunk of every task and returns how many there are
+static size_t ecs_par_each_tasks(ECSWorld *w, ECSEntityMask mask, ECSParTasks *tasks) {
+#ifdef ECS_ARCHETYPES
+    tasks->count = 0;
+    for(size_t i = 0; i < w->archetypes.count; ++i) {
+        ECSArchetype *a = &w->archetypes.items[i];
+        if(!ecs_mask_contains(&a->mask, &mask)) continue;
+        size_t chunks = (a->count + a->chunk_capacity - 1) / a->chunk_capacity;
+        ecs_da_reserve(tasks, tasks->count + 2 * chunks);
+        for(size_t c = 0; c < chunks; ++c) {
+            tasks->items[tasks->count++] = i;
+            tasks->items[tasks->count++] = c;
+        }
+    }
+    return tasks->count / 2;
+#else
+    (void)mask; (void)tasks;
+    return (w->entities.count + ECS_PAR_GRAIN - 1) / ECS_PAR_GRAIN;
+#endif
+}
+
+#ifndef ECS_NO_THREADS
+static _Thread_local size_t ecs_worker;
+static _Thread_local ECSThreadPool *ecs_worker_pool;
+
+static bool ecs_worker_take(ECSWorkerQueue *q, bool back, size_t *task) {
+    uint64_t range = atomic_load_explicit(&q->range, memory_order_relaxed);
+    for(;;) {
+        uint64_t lo = range & 0xFFFFFFFF, hi = range >> 32;
+        if(lo >= hi) return false;
+        uint64_t next = back ? (lo | (hi - 1) << 32) : ((lo + 1) | hi << 32);
+        if(atomic_compare_exchange_weak_explicit(&q->range, &range, next, memory_order_acq_rel, memory_order_relaxed)) {
+            *task = back ? hi - 1 : lo;
+            return true;
+        }
+    }
+}
+
+static void ecs_thread_pool_work(ECSThreadPool *pool, size_t worker) {
+    ECSPoolJob *job = &pool->job;
+    size_t task;
+    for(;;) {
+        bool found = ecs_worker_take(&pool->queues[worker], false, &task);
+        // steal from the back of the other queues, the owners keep eating their fronts
+        for(size_t i = 1; !found && !(job->flags & ECS_PAR_DETERMINISTIC) && i < pool->count; ++i) {
+            found = ecs_worker_take(&pool->queues[(worker + i) % pool->count], true, &task);
+        }
+        if(!found) return;
+        job->run(job->data, task);
+    }
+}
+
+static void* ecs_thread_pool_main(void *arg) {
+    ECSThreadPool *pool = ((void**)arg)[0];
+    size_t worker = (size_t)((void**)arg)[1];
+    ECS_FREE(arg);
+    ecs_worker = worker;
+    ecs_worker_pool = pool;
+    size_t seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    for(;;) {
+        while(!pool->quit && pool->generation == seen) pthread_cond_wait(&pool->wake, &pool->lock);
+        if(pool->quit) break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+        ecs_thread_pool_work(pool, worker);
+        pthread_mutex_lock(&pool->lock);
+        if(--pool->running == 0) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+void ecs_thread_pool_init(ECSThreadPool *pool, size_t threads) {
+    *pool = (ECSThreadPool){ .count = threads > 0 ? threads : 1 };
+    pool->queues = ECS_REALLOC(NULL, pool->count * sizeof(ECSWorkerQueue));
+    pool->threads = ECS_REALLOC(NULL, pool->count * sizeof(pthread_t));
+    ECS_ASSERT(pool->queues != NULL && pool->threads != NULL && "Buy more RAM lol");
+    for(size_t i = 0; i < pool->count; ++i) atomic_init(&pool->queues[i].range, 0);
+    pthread_mutex_init(&pool->submit, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for(size_t i = 1; i < pool->count; ++i) {
+        void **arg = ECS_REALLOC(NULL, 2 * sizeof(void*));
+        ECS_ASSERT(arg != NULL && "Buy more RAM lol");
+        arg[0] = pool;
+        arg[1] = (void*)i;
+        int err = pthread_create(&pool->threads[i], NULL, ecs_thread_pool_main, arg);
+        ECS_ASSERT(err == 0 && "Could not start worker thread");
+        (void)err;
+    }
+}
+
+void ecs_thread_pool_destroy(ECSThreadPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for(size_t i = 1; i < pool->count; ++i) pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->submit);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->done);
+    ECS_FREE(pool->queues);
+    ECS_FREE(pool->threads);
+    ECS_FREE(pool->tasks.items);
+    *pool = (ECSThreadPool){0};
+}
+
+// Runs a job with `submit` already held
+static void ecs_thread_pool_dispatch(ECSThreadPool *pool, size_t task_count, unsigned flags, ECSPoolTaskFn run, void *data) {
+    ECS_ASSERT(task_count <= 0xFFFFFFFF);
+    pool->job = (ECSPoolJob){ run, data, flags };
+    for(size_t i = 0; i < pool->count; ++i) {
+        uint64_t lo = task_count * i / pool->count, hi = task_count * (i + 1) / pool->count;
+        atomic_store_explicit(&pool->queues[i].range, lo | hi << 32, memory_order_relaxed);
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->generation++;
+    pool->running = pool->count - 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    ECSThreadPool *outer = ecs_worker_pool;
+    size_t outer_worker = ecs_worker;
+    ecs_worker_pool = pool;
+    ecs_worker = 0;
+    ecs_thread_pool_work(pool, 0);
+    ecs_worker_pool = outer;
+    ecs_worker = outer_worker;
+
+    pthread_mutex_lock(&pool->lock);
+    while(pool->running > 0) pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void ecs_thread_pool_run(ECSThreadPool *pool, size_t task_count, unsigned flags, ECSPoolTaskFn run, void *data) {
+    // a job started from inside a worker can't wait on its own pool, it runs right there
+    if(pool->count == 1 || ecs_worker_pool == pool) {
+        for(size_t i = 0; i < task_count; ++i) run(data, i);
+        return;
+    }
+    pthread_mutex_lock(&pool->submit);
+    ecs_thread_pool_dispatch(pool, task_count, flags, run, data);
+    pthread_mutex_unlock(&pool->submit);
+}
+
+void ecs_set_thread_pool(ECSWorld *w, ECSThreadPool *pool) {
+    w->pool = pool;
+}
+
+static ECSThreadPool ecs_default_pool;
+static pthread_once_t ecs_default_pool_once = PTHREAD_ONCE_INIT;
+
+static void ecs_default_pool_init() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    ecs_thread_pool_init(&ecs_default_pool, cores > 0 ? (size_t)cores : 1);
+}
+
+static ECSThreadPool* ecs_world_pool(ECSWorld *w) {
+    if(w->pool != NULL) return w->pool;
+    pthread_once(&ecs_default_pool_once, ecs_default_pool_init);
+    return &ecs_default_pool;
+}
+#endif // ECS_NO_THREADS
+
+size_t ecs_worker_index() {
+#ifndef ECS_NO_THREADS
+    return ecs_worker;
+#else
+    return 0;
+#endif
+}
+
+void ecs_query_par_each(ECSWorld *w, ECSEntityMask mask, ECSParEachFn fn, void *ctx) {
+    ecs_query_par_each_ex(w, mask, fn, ctx, 0);
+}
+
+void ecs_query_par_each_ex(ECSWorld *w, ECSEntityMask mask, ECSParEachFn fn, void *ctx, unsigned flags) {
+    ECSParEach job = { w, mask, fn, ctx, NULL, "ecs_query_par_each" };
+#ifdef ECS_PROFILE
+    if(ecs_profile_zone != NULL) job.zone = ecs_profile_zone;
+#endif
+#ifndef ECS_NO_THREADS
+    ECSThreadPool *pool = ecs_world_pool(w);
+    if(pool->count > 1 && ecs_worker_pool != pool) {
+        // the task list lives in the pool, so it is only touched while holding `submit`
+        pthread_mutex_lock(&pool->submit);
+        size_t task_count = ecs_par_each_tasks(w, mask, &pool->tasks);
+        job.tasks = pool->tasks.items;
+        ecs_thread_pool_dispatch(pool, task_count, flags, ecs_par_each_task, &job);
+        pthread_mutex_unlock(&pool->submit);
+        return;
+    }
+#endif
+    (void)flags;
+    ECSParTasks tasks = {0};
+    size_t task_count = ecs_par_each_tasks(w, mask, &tasks);
+    job.tasks = tasks.items;
+    for(size_t i = 0; i < task_count; ++i) ecs_par_each_task(&job, i);
+    ECS_FREE(tasks.items);
+}
+
+size_t ecs_scheduler_add(ECSScheduler *s, const char *name, ECSSystemFn fn, ECSEntityMask reads, ECSEntityMask writes) {
+    ECSSystem system = {
+        .name = name,
+        .fn = fn,
+        .reads = reads,
+        .writes = writes,
+    };
+    size_t id = s->systems.count;
+    for(size_t i = 0; i < id; ++i) {
+        ECSSystem *before = &s->systems.items[i];
+        bool conflict = ecs_mask_intersects(&before->writes, &writes) ||
+                        ecs_mask_intersects(&before->writes, &reads) ||
+                        ecs_mask_intersects(&before->reads, &writes);
+        if(!conflict) continue;
+        ecs_da_append(&before->dependents, id);
+        system.depends_on++;
+    }
+    ecs_da_append(&s->systems, system);
+    return id;
+}
+
+#ifndef ECS_NO_THREADS
+// Every worker keeps taking systems whose dependencies are done until all of them ran
+static void ecs_scheduler_work(void *data, size_t task) {
+    ECSScheduler *s = data;
+    (void)task;
+    pthread_mutex_lock(&s->lock);
+    for(;;) {
+        while(s->ready.count == 0 && s->finished < s->systems.count) pthread_cond_wait(&s->wake, &s->lock);
+        if(s->finished == s->systems.count) break;
+        ECSSystem *system = &s->systems.items[s->ready.items[--s->ready.count]];
+        pthread_mutex_unlock(&s->lock);
+        system->fn(s->world);
+        pthread_mutex_lock(&s->lock);
+        s->finished++;
+        ecs_da_foreach(size_t, it, &system->dependents) {
+            if(--s->waiting[*it] == 0) s->ready.items[s->ready.count++] = *it;
+        }
+        pthread_cond_broadcast(&s->wake);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+#endif
+
+void ecs_scheduler_run(ECSScheduler *s, ECSWorld *w) {
+#ifndef ECS_NO_THREADS
+    ECSThreadPool *pool = ecs_world_pool(w);
+    if(s->systems.count > 1 && pool->count > 1 && ecs_worker_pool != pool) {
+        s->world = w;
+        s->finished = 0;
+        s->waiting = ECS_REALLOC(s->waiting, s->systems.count * sizeof(size_t));
+        ECS_ASSERT(s->waiting != NULL && "Buy more RAM lol");
+        ecs_da_reserve(&s->ready, s->systems.count);
+        s->ready.count = 0;
+        // pushed backwards so the systems that are ready from the start get popped in order
+        for(size_t i = s->systems.count; i-- > 0;) {
+            s->waiting[i] = s->systems.items[i].depends_on;
+            if(s->waiting[i] == 0) s->ready.items[s->ready.count++] = i;
+        }
+        pthread_mutex_init(&s->lock, NULL);
+        pthread_cond_init(&s->wake, NULL);
+        ecs_thread_pool_run(pool, pool->count, ECS_PAR_DETERMINISTIC, ecs_scheduler_work, s);
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->wake);
+        return;
+    }
+#endif
+    // adding order is always a valid order
+    ecs_da_foreach(ECSSystem, it, &s->systems) {
+        it->fn(w);
+    }
+}
+
+void ecs_scheduler_free(ECSScheduler *s) {
+    ecs_da_foreach(ECSSystem, it, &s->systems) {
+        ECS_FREE(it->dependents.items);
+    }
+    ECS_FREE(s->systems.items);
+#ifndef ECS_NO_THREADS
+    ECS_FREE(s->waiting);
+    ECS_FREE(s->ready.items);
+#endif
+    *s = (ECSScheduler){0};
+}
+
+ECSEntityId ecs_cmd_spawn(ECSCommandBuffer *cb) {
+    ECS_ASSERT(cb->spawns <= ECS_ENTITY_INDEX_MASK && "Out of entity ids");
+    return ECS_ENTITY_DEAD | cb->spawns++;
+}
+
+static void ecs_cmd_push(ECSCommandBuffer *cb, ECSCommandKind kind, ECSEntityId id, size_t component) {
+    ECSCommand cmd = {
+        .kind = kind,
+        .entity = id,
+        .component = component,
+        .value = cb->values.count,
+        .seq = cb->commands.count,
+    };
+    ecs_da_append_with(cb->allocator, &cb->commands, cmd);
+}
+
+void ecs_cmd_despawn(ECSCommandBuffer *cb, ECSEntityId id) {
+    ecs_cmd_push(cb, ECS_CMD_DESPAWN, id, ECS_NO_COMPONENT);
+}
+
+void ecs_cmd_add(ECSCommandBuffer *cb, ECSEntityId id, size_t component, const void *value) {
+    ECS_ASSERT(component < ecs_components.count && "Component is not registered");
+    ECS_ASSERT(!ecs_is_resource(component) && "Resources live in the world, not on entities");
+    ecs_cmd_push(cb, ECS_CMD_ADD, id, component);
+    size_t size = ecs_components.items[component].size;
+    ecs_da_reserve_with(cb->allocator, &cb->values, cb->values.count + size);
+    if(size > 0) memcpy(cb->values.items + cb->values.count, value, size);
+    cb->values.count += size;
+}
+
+void ecs_cmd_remove(ECSCommandBuffer *cb, ECSEntityId id, size_t component) {
+    ECS_ASSERT(component < ecs_components.count && "Component is not registered");
+    ecs_cmd_push(cb, ECS_CMD_REMOVE, id, component);
+}
+
+// Despawns go last (their component is ECS_NO_COMPONENT), ties keep the recording order
+static int ecs_cmd_compare(const void *a, const void *b) {
+    const ECSCommand *x = a, *y = b;
+    if(x->component != y->component) return x->component < y->component ? -1 : 1;
+    if(x->entity != y->entity) return x->entity < y->entity ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+void ecs_cmd_flush(ECSCommandBuffer *cb, ECSWorld *w, ECSEntityId *spawned) {
+    // pending ids map to the entities spawned here, in the order ecs_cmd_spawn() gave them out
+    ecs_da_reserve_with(cb->allocator, &cb->scratch_ids, cb->spawns);
+    ecs_spawn_entities(w, cb->spawns, cb->scratch_ids.items);
+    if(spawned != NULL && cb->spawns > 0) memcpy(spawned, cb->scratch_ids.items, cb->spawns * sizeof(ECSEntityId));
+    ecs_da_foreach(ECSCommand, it, &cb->commands) {
+        if(ecs_entity_is_pending(it->entity)) it->entity = cb->scratch_ids.items[ecs_entity_index(it->entity)];
+    }
+    if(cb->commands.count > 1) qsort(cb->commands.items, cb->commands.count, sizeof(ECSCommand), ecs_cmd_compare);
+
+    for(size_t i = 0; i < cb->commands.count;) {
+        size_t component = cb->commands.items[i].component;
+        size_t end = i;
+        while(end < cb->commands.count && cb->commands.items[end].component == component) end++;
+        size_t size = component == ECS_NO_COMPONENT ? 0 : ecs_components.items[component].size;
+        cb->scratch_ids.count = 0;
+        cb->scratch_removes.count = 0;
+        cb->scratch_values.count = 0;
+        for(; i < end; ++i) {
+            ECSCommand *cmd = &cb->commands.items[i];
+            // only the last command recorded for an entity and component matters
+            if(i + 1 < end && cb->commands.items[i + 1].entity == cmd->entity) continue;
+            if(cmd->kind == ECS_CMD_REMOVE) {
+                ecs_da_append_with(cb->allocator, &cb->scratch_removes, cmd->entity);
+                continue;
+            }
+            if(cmd->kind == ECS_CMD_ADD && !ecs_is_alive(w, cmd->entity)) continue;
+            ecs_da_append_with(cb->allocator, &cb->scratch_ids, cmd->entity);
+            ecs_da_reserve_with(cb->allocator, &cb->scratch_values, cb->scratch_values.count + size);
+            if(size > 0) memcpy(cb->scratch_values.items + cb->scratch_values.count, cb->values.items + cmd->value, size);
+            cb->scratch_values.count += size;
+        }
+        if(component == ECS_NO_COMPONENT) {
+            ecs_despawn_entities(w, cb->scratch_ids.items, cb->scratch_ids.count);
+            continue;
+        }
+        ecs_component_remove_batch(w, component, cb->scratch_removes.items, cb->scratch_removes.count);
+        if(cb->scratch_ids.count > 0) {
+            ecs_component_add_bulk(w, component, cb->scratch_ids.items, cb->scratch_values.items, cb->scratch_ids.count);
+        }
+    }
+    cb->commands.count = 0;
+    cb->values.count = 0;
+    cb->spawns = 0;
+}
+
+void ecs_cmd_free(ECSCommandBuffer *cb) {
+    ecs_da_free_with(cb->allocator, &cb->commands);
+    ecs_da_free_with(cb->allocator, &cb->values);
+    ecs_da_free_with(cb->allocator, &cb->scratch_ids);
+    ecs_da_free_with(cb->allocator, &cb->scratch_removes);
+    ecs_da_free_with(cb->allocator, &cb->scratch_values);
+    *cb = (ECSCommandBuffer){ .allocator = cb->allocator };
+}
+
+// ----------------------
+// Snapshots
+// ----------------------
+#define ecs_snapshot_align(offset) ecs_align_up((offset), (size_t)ECS_SNAPSHOT_ALIGN)
+
+typedef struct {
+    FILE *file;
+    size_t offset;
+    bool ok;
+} ECSSnapshotWriter;
+
+// Pads up to `offset` before writing, sections are laid out ahead of time
+static void ecs_snapshot_write(ECSSnapshotWriter *out, size_t offset, const void *data, size_t size) {
+    static const unsigned char zeros[ECS_SNAPSHOT_ALIGN];
+    while(out->ok && out->offset < offset) {
+        size_t n = offset - out->offset < sizeof(zeros) ? offset - out->offset : sizeof(zeros);
+        out->ok = fwrite(zeros, 1, n, out->file) == n;
+        out->offset += n;
+    }
+    if(out->ok && size > 0) out->ok = fwrite(data, 1, size, out->file) == size;
+    out->offset += size;
+}
+
+// Tags have no values to save, the entity masks bring them back
+static size_t ecs_snapshot_count(ECSWorld *w, size_t component) {
+    if(ecs_is_tag(component)) return 0;
+#ifdef ECS_ARCHETYPES
+    size_t count = 0;
+    ecs_da_foreach(ECSArchetype, a, &w->archetypes) {
+        if(ecs_mask_test(&a->mask, component)) count += a->count;
+    }
+    return count;
+#else
+    return component < w->storages.count ? w->storages.items[component].dense.count : 0;
+#endif
+}
+
+bool ecs_world_save(ECSWorld *w, const char *path) {
+    size_t component_count = ecs_components.count;
+    ECSSnapshotHeader header = {
+        .magic = ECS_SNAPSHOT_MAGIC,
+        .version = ECS_SNAPSHOT_VERSION,
+        .tick = w->tick,
+        .mask_words = ECS_MASK_WORDS,
+        .entity_count = w->entities.count,
+        .dead_count = w->dead_entities.count,
+        .component_count = component_count,
+    };
+    ECSSnapshotComponent *table = ecs_mem_alloc(w->allocator, component_count * sizeof(ECSSnapshotComponent) + 1);
+    ECS_ASSERT(table != NULL && "Buy more RAM lol");
+    size_t offset = sizeof(header) + component_count * sizeof(ECSSnapshotComponent);
+    header.entities = offset = ecs_snapshot_align(offset);
+    header.masks = offset = ecs_snapshot_align(offset + w->entities.count * sizeof(ECSEntityId));
+    header.dead = offset = ecs_snapshot_align(offset + w->entities.count * sizeof(ECSEntityMask));
+    offset += w->dead_entities.count * sizeof(ECSEntityId);
+    for(size_t c = 0; c < component_count; ++c) {
+        ECSSnapshotComponent *it = &table[c];
+        memset(it, 0, sizeof(*it));
+        ECS_ASSERT(strlen(ecs_components.items[c].name) < ECS_SNAPSHOT_NAME_MAX && "Component name is too long for snapshots");
+        strcpy(it->name, ecs_components.items[c].name);
+        it->size = ecs_components.items[c].size;
+        it->count = ecs_snapshot_count(w, c);
+        it->ids = offset = ecs_snapshot_align(offset);
+        it->ticks = offset = ecs_snapshot_align(offset + it->count * sizeof(ECSEntityId));
+        it->data = offset = ecs_snapshot_align(offset + it->count * sizeof(ECSTicks));
+        offset += it->count * it->size;
+    }
+
+    ECSSnapshotWriter out = { .file = fopen(path, "wb"), .ok = true };
+    if(out.file == NULL) {
+        ecs_mem_free(w->allocator, table, component_count * sizeof(ECSSnapshotComponent) + 1);
+        return false;
+    }
+    ecs_snapshot_write(&out, 0, &header, sizeof(header));
+    ecs_snapshot_write(&out, out.offset, table, component_count * sizeof(ECSSnapshotComponent));
+    // ECSEntity carries more than the id and mask, so the entity table is written field by field
+    for(size_t i = 0; i < w->entities.count; ++i) {
+        ecs_snapshot_write(&out, header.entities + i * sizeof(ECSEntityId), &w->entities.items[i].id, sizeof(ECSEntityId));
+    }
+    for(size_t i = 0; i < w->entities.count; ++i) {
+        ecs_snapshot_write(&out, header.masks + i * sizeof(ECSEntityMask), &w->entities.items[i].mask, sizeof(ECSEntityMask));
+    }
+    ecs_snapshot_write(&out, header.dead, w->dead_entities.items, w->dead_entities.count * sizeof(ECSEntityId));
+    for(size_t c = 0; c < component_count; ++c) {
+        ECSSnapshotComponent *it = &table[c];
+        if(it->count == 0) continue;
+#ifdef ECS_ARCHETYPES
+        // one column after the other, each chunk adds a contiguous run of rows
+        for(size_t section = 0; section < 3; ++section) {
+            size_t start = section == 0 ? it->ids : section == 1 ? it->ticks : it->data;
+            ecs_snapshot_write(&out, start, NULL, 0);
+            ecs_da_foreach(ECSArchetype, a, &w->archetypes) {
+                if(!ecs_mask_test(&a->mask, c)) continue;
+                size_t col = ecs_archetype_column(a, c);
+                for(size_t k = 0; k * a->chunk_capacity < a->count; ++k) {
+                    size_t rows = a->count - k * a->chunk_capacity;
+                    if(rows > a->chunk_capacity) rows = a->chunk_capacity;
+                    unsigned char *chunk = a->chunks.items[k];
+                    if(section == 0) ecs_snapshot_write(&out, out.offset, chunk, rows * sizeof(ECSEntityId));
+                    if(section == 1) ecs_snapshot_write(&out, out.offset, chunk + a->tick_offsets[col], rows * sizeof(ECSTicks));
+                    if(section == 2) ecs_snapshot_write(&out, out.offset, chunk + a->offsets[col], rows * it->size);
+                }
+            }
+        }
+#else
+        ECSSparseSet *set = &w->storages.items[c];
+        ecs_snapshot_write(&out, it->ids, set->dense.items, it->count * sizeof(ECSEntityId));
+        ecs_snapshot_write(&out, it->ticks, set->ticks, it->count * sizeof(ECSTicks));
+        ecs_snapshot_write(&out, it->data, set->data, it->count * it->size);
+#endif
+    }
+    ecs_mem_free(w->allocator, table, component_count * sizeof(ECSSnapshotComponent) + 1);
+    if(fclose(out.file) != 0) out.ok = false;
+    return out.ok;
+}
+
+// Maps the whole file copy-on-write, or reads it into memory where mmap isn't available
+static unsigned char* ecs_snapshot_map(ECSWorld *w, const char *path, size_t *size) {
+#ifndef ECS_NO_MMAP
+    (void)w;
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return NULL;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    *size = (size_t)st.st_size;
+    void *base = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return base == MAP_FAILED ? NULL : base;
+#else
+    FILE *f = fopen(path, "rb");
+    if(f == NULL) return NULL;
+    long end = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+    unsigned char *base = end > 0 ? ecs_mem_alloc(w->allocator, (size_t)end) : NULL;
+    if(base != NULL) {
+        *size = (size_t)end;
+        rewind(f);
+        if(fread(base, 1, *size, f) != *size) {
+            ecs_mem_free(w->allocator, base, *size);
+            base = NULL;
+        }
+    }
+    fclose(f);
+    return base;
+#endif
+}
+
+static void ecs_snapshot_release(ECSWorld *w, unsigned char *base, size_t size) {
+    if(base == NULL) return;
+#ifndef ECS_NO_MMAP
+    (void)w;
+    munmap(base, size);
+#else
+    ecs_mem_free(w->allocator, base, size);
+#endif
+}
+
+static bool ecs_snapshot_fits(size_t size, uint64_t offset, uint64_t count, uint64_t item) {
+    return offset <= size && (item == 0 || count <= (size - offset) / item);
+}
+
+bool ecs_world_load(ECSWorld *w, const char *path) {
+    ECS_ASSERT(w->entities.count == 0 && "ecs_world_load() needs an empty world");
+    size_t size = 0;
+    unsigned char *base = ecs_snapshot_map(w, path, &size);
+    if(base == NULL) return false;
+    ECSSnapshotHeader *header = (ECSSnapshotHeader*)base;
+    ECSSnapshotComponent *table = (ECSSnapshotComponent*)(header + 1);
+    size_t remap[ECS_MAX_COMPONENTS];
+    bool ok = size >= sizeof(*header)
+        && memcmp(header->magic, ECS_SNAPSHOT_MAGIC, 4) == 0
+        && header->version == ECS_SNAPSHOT_VERSION
+        && header->component_count <= ECS_MAX_COMPONENTS
+        && header->mask_words <= UINT64_MAX / 64
+        && header->component_count <= header->mask_words * 64
+        && ecs_snapshot_fits(size, sizeof(*header), header->component_count, sizeof(ECSSnapshotComponent))
+        && header->entity_count <= (uint64_t)ECS_ENTITY_INDEX_MASK + 1
+        && ecs_snapshot_fits(size, header->entities, header->entity_count, sizeof(ECSEntityId))
+        && ecs_snapshot_fits(size, header->masks, header->entity_count, header->mask_words * sizeof(uint64_t))
+        && ecs_snapshot_fits(size, header->dead, header->dead_count, sizeof(ECSEntityId))
+        // the sections are read in place, so they have to be aligned for it
+        && (header->entities | header->masks | header->dead) % sizeof(uint64_t) == 0;
+    for(size_t j = 0; ok && j < header->component_count; ++j) {
+        ECSSnapshotComponent *it = &table[j];
+        remap[j] = ECS_NO_COMPONENT;
+        for(size_t c = 0; c < ecs_components.count; ++c) {
+            if(strncmp(ecs_components.items[c].name, it->name, ECS_SNAPSHOT_NAME_MAX) == 0) remap[j] = c;
+        }
+        // empty entries (tags among them) may point past the end of the file, nothing is read there
+        ok = it->count == 0 || (remap[j] != ECS_NO_COMPONENT && ecs_components.items[remap[j]].size == it->size
+            && it->count <= header->entity_count
+            && it->ids % sizeof(ECSEntityId) == 0 && it->ticks % sizeof(uint32_t) == 0
+            && ecs_snapshot_fits(size, it->ids, it->count, sizeof(ECSEntityId))
+            && ecs_snapshot_fits(size, it->ticks, it->count, sizeof(ECSTicks))
+            && ecs_snapshot_fits(size, it->data, it->count, it->size)
+            && (it->data % ECS_SNAPSHOT_ALIGN) == 0);
+    }
+    if(!ok) {
+        ecs_snapshot_release(w, base, size);
+        return false;
+    }
+
+    const ECSEntityId *ids = (const ECSEntityId*)(base + header->entities);
+    const uint64_t *masks = (const uint64_t*)(base + header->masks);
+    ecs_da_reserve_with(w->allocator, &w->entities, header->entity_count);
+    for(size_t i = 0; i < header->entity_count; ++i) {
+        ECSEntity e = { .id = ids[i] };
+        for(size_t j = 0; j < header->component_count; ++j) {
+            if((masks[i * header->mask_words + j / 64] >> (j % 64)) & 1) {
+                if(remap[j] == ECS_NO_COMPONENT) ok = false;
+                else ecs_mask_set(&e.mask, remap[j]);
+            }
+        }
+        if(ecs_entity_index(e.id) != i) ok = false;
+        w->entities.items[w->entities.count++] = e;
+    }
+    const ECSEntityId *dead = (const ECSEntityId*)(base + header->dead);
+    ecs_da_reserve_with(w->allocator, &w->dead_entities, header->dead_count);
+    for(size_t i = 0; i < header->dead_count; ++i) {
+        if(dead[i] >= header->entity_count) ok = false;
+        w->dead_entities.items[w->dead_entities.count++] = dead[i];
+    }
+    // spawning pops the free list, so it has to hold every dead slot exactly once and nothing
+    // alive. Listed slots lose ECS_ENTITY_DEAD while checking, which catches a slot listed twice.
+    size_t dead_slots = 0;
+    for(size_t i = 0; i < w->entities.count; ++i) {
+        ECSEntity *e = &w->entities.items[i];
+        if(!(e->id & ECS_ENTITY_DEAD)) continue;
+        dead_slots++;
+        if(!ecs_mask_is_empty(&e->mask)) ok = false;
+    }
+    if(dead_slots != w->dead_entities.count) ok = false;
+    size_t checked = 0;
+    for(; ok && checked < w->dead_entities.count; ++checked) {
+        ECSEntity *e = &w->entities.items[w->dead_entities.items[checked]];
+        if(!(e->id & ECS_ENTITY_DEAD)) { ok = false; break; }
+        e->id &= ~ECS_ENTITY_DEAD;
+    }
+    for(size_t i = 0; i < checked; ++i) w->entities.items[w->dead_entities.items[i]].id |= ECS_ENTITY_DEAD;
+    w->tick = (uint32_t)header->tick;
+#ifdef ECS_ARCHETYPES
+    for(size_t i = 0; ok && i < w->entities.count; ++i) {
+        ECSEntity *e = &w->entities.items[i];
+        if(e->id & ECS_ENTITY_DEAD) continue;
+        e->archetype = ecs_archetype_find(w, e->mask);
+        e->row = ecs_archetype_push(w, e->archetype, e->id);
+    }
+#endif
+    for(size_t j = 0; ok && j < header->component_count; ++j) {
+        ECSSnapshotComponent *it = &table[j];
+        size_t c = remap[j];
+        const ECSEntityId *owners = (const ECSEntityId*)(base + it->ids);
+        const ECSTicks *ticks = (const ECSTicks*)(base + it->ticks);
+        for(size_t i = 0; ok && i < it->count; ++i) {
+            ECSEntity *e = ecs_get_entity_with_id(w, owners[i]);
+            ok = e != NULL && ecs_mask_test(&e->mask, c);
+        }
+        if(!ok) break;
+        if(it->count == 0) continue;
+#ifdef ECS_ARCHETYPES
+        for(size_t i = 0; i < it->count; ++i) {
+            ECSEntity *e = ecs_get_entity_with_id(w, owners[i]);
+            ECSArchetype *a = &w->archetypes.items[e->archetype];
+            size_t col = ecs_archetype_column(a, c);
+            memcpy(ecs_archetype_cell(a, col, e->row), base + it->data + i * it->size, it->size);
+            ecs_archetype_set_ticks(a, col, e->row, ticks[i]);
+        }
+#else
+        ECSSparseSet *set = ecs_world_storage(w, c);
+        // exactly `count` slots, so the first insert copies the borrowed values out
+        set->dense.items = ecs_mem_alloc(set->allocator, it->count * sizeof(ECSEntityId));
+        set->ticks = ecs_mem_alloc(set->allocator, it->count * sizeof(ECSTicks));
+        size_t blocks = (it->count + ECS_TICK_BLOCK - 1) / ECS_TICK_BLOCK;
+        set->block_ticks = ecs_mem_alloc(set->allocator, blocks * sizeof(ECSTicks));
+        ECS_ASSERT(set->dense.items != NULL && set->ticks != NULL && set->block_ticks != NULL && "Buy more RAM lol");
+        set->dense.capacity = set->dense.count = it->count;
+        memcpy(set->dense.items, owners, it->count * sizeof(ECSEntityId));
+        memcpy(set->ticks, ticks, it->count * sizeof(ECSTicks));
+        memset(set->block_ticks, 0, blocks * sizeof(ECSTicks));
+        for(size_t i = 0; i < it->count; ++i) {
+            *ecs_sparse_slot(set, owners[i], true) = i;
+            ECSTicks *block = &set->block_ticks[i / ECS_TICK_BLOCK];
+            for(size_t k = 0; k < 2; ++k) {
+                if((*block)[k] < ticks[i][k]) (*block)[k] = ticks[i][k];
+            }
+        }
+        if(it->size > 0) {
+            set->data = base + it->data;
+            set->borrowed = true;
+        }
+#endif
+    }
+    if(!ok) {
+        // the world is left empty, ecs_deinit() knows which values are borrowed
+#ifdef ECS_ARCHETYPES
+        ecs_snapshot_release(w, base, size);
+#else
+        w->snapshot = base;
+        w->snapshot_size = size;
+#endif
+        ecs_deinit(w);
+        return false;
+    }
+#ifdef ECS_ARCHETYPES
+    ecs_snapshot_release(w, base, size);
+#else
+    for(size_t i = 0; i < w->entities.count; ++i) {
+        if(!ecs_mask_is_empty(&w->entities.items[i].mask)) ecs_queries_update(w, &w->entities.items[i], (ECSEntityMask){0});
+    }
+    w->snapshot = base;
+    w->snapshot_size = size;
+#endif
+    return true;
+}
+
+// ----------------------
+// Replication
+// ----------------------
+static void ecs_delta_put(ECSDelta *out, const void *data, size_t size) {
+    ecs_da_reserve_with(out->allocator, out, out->count + size);
+    memcpy(out->items + out->count, data, size);
+    out->count += size;
+}
+
+// LEB128, ids and masks are mostly small numbers
+static void ecs_delta_put_varint(ECSDelta *out, uint64_t value) {
+    unsigned char bytes[10];
+    size_t n = 0;
+    do {
+        bytes[n++] = (unsigned char)((value & 0x7F) | (value >= 0x80 ? 0x80 : 0));
+        value >>= 7;
+    } while(value != 0);
+    ecs_delta_put(out, bytes, n);
+}
+
+// Runs of (unchanged bytes, changed bytes, the changed bytes XOR the old ones) covering `size`
+static void ecs_delta_put_xor(ECSDelta *out, const unsigned char *value, const unsigned char *base, size_t size) {
+#define ecs_delta_changed(i) (value[i] != (base ? base[i] : 0))
+    for(size_t i = 0; i < size;) {
+        size_t start = i;
+        while(i < size && !ecs_delta_changed(i)) i++;
+        size_t zeros = i - start;
+        start = i;
+        // a single unchanged byte costs less inside the run than as a new pair of counts
+        while(i < size && (ecs_delta_changed(i) || (i + 1 < size && ecs_delta_changed(i + 1)))) i++;
+        ecs_delta_put_varint(out, zeros);
+        ecs_delta_put_varint(out, i - start);
+        ecs_da_reserve_with(out->allocator, out, out->count + i - start);
+        for(size_t k = start; k < i; ++k) out->items[out->count++] = value[k] ^ (base ? base[k] : 0);
+    }
+#undef ecs_delta_changed
+}
+
+void ecs_delta_encode(ECSWorld *w, ECSWorld *mirror, ECSDelta *out) {
+    out->count = 0;
+    ecs_delta_put(out, ECS_DELTA_MAGIC, 4);
+    ecs_delta_put_varint(out, ECS_DELTA_VERSION);
+    ecs_delta_put_varint(out, w->tick);
+    ecs_delta_put_varint(out, ecs_components.count);
+    for(size_t c = 0; c < ecs_components.count; ++c) ecs_delta_put_varint(out, ecs_components.items[c].size);
+    ecs_delta_put_varint(out, w->entities.count);
+
+    // entity slots, zero terminated
+    for(size_t i = 0; i < w->entities.count; ++i) {
+        ECSEntity *e = &w->entities.items[i];
+        ECSEntity *m = i < mirror->entities.count ? &mirror->entities.items[i] : NULL;
+        if(m != NULL && m->id == e->id && ecs_mask_equals(&m->mask, &e->mask)) continue;
+        ecs_delta_put_varint(out, i + 1);
+        ecs_delta_put_varint(out, e->id);
+        for(size_t k = 0; k < ECS_MASK_WORDS; ++k) ecs_delta_put_varint(out, e->mask.words[k]);
+    }
+    ecs_delta_put_varint(out, 0);
+
+    // free list, 0 when unchanged
+    if(w->dead_entities.count == mirror->dead_entities.count
+       && (w->dead_entities.count == 0 || memcmp(w->dead_entities.items, mirror->dead_entities.items, w->dead_entities.count * sizeof(ECSEntityId)) == 0)) {
+        ecs_delta_put_varint(out, 0);
+    } else {
+        ecs_delta_put_varint(out, w->dead_entities.count + 1);
+        ecs_da_foreach(ECSEntityId, it, &w->dead_entities) ecs_delta_put_varint(out, *it);
+    }
+
+    // values written since the mirror was last updated, grouped by component
+    for(size_t c = 0; c < ecs_components.count; ++c) {
+        if(ecs_is_tag(c)) continue;
+        size_t size = ecs_components.items[c].size;
+        size_t term = c | ECS_TERM_CHANGED;
+        bool any = false;
+        for(ECSFilterIter it = ecs_filter_iter(w, ecs_filter_of(&term, 1, mirror->tick)); ecs_filter_iter_next(&it);) {
+            ECSEntity *e = it.entity;
+            size_t i = ecs_entity_index(e->id);
+            ECSEntity *m = i < mirror->entities.count ? &mirror->entities.items[i] : NULL;
+            const unsigned char *base = NULL;
+            if(m != NULL && m->id == e->id && ecs_mask_test(&m->mask, c)) base = ecs_component_get(mirror, m, c);
+            const unsigned char *value = ecs_component_get(w, e, c);
+            if(base != NULL && memcmp(base, value, size) == 0) continue;
+            if(!any) ecs_delta_put_varint(out, c + 1);
+            any = true;
+            ecs_delta_put_varint(out, i + 1);
+            ecs_delta_put_xor(out, value, base, size);
+        }
+        if(any) ecs_delta_put_varint(out, 0);
+    }
+    ecs_delta_put_varint(out, 0);
+
+    bool ok = ecs_delta_apply(mirror, out->items, out->count);
+    ECS_ASSERT(ok && "Mirror is out of sync");
+    (void)ok;
+}
+
+typedef struct {
+    const unsigned char *at, *end;
+    bool ok;
+} ECSDeltaReader;
+
+static uint64_t ecs_delta_get_varint(ECSDeltaReader *r) {
+    uint64_t value = 0;
+    for(unsigned shift = 0; r->ok; shift += 7) {
+        if(r->at == r->end || shift > 63) {
+            r->ok = false;
+            break;
+        }
+        unsigned char byte = *r->at++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if(!(byte & 0x80)) break;
+    }
+    return r->ok ? value : 0;
+}
+
+// `size` entries are needed and indices are 1 based, 0 (or garbage) ends the list
+static size_t ecs_delta_get_index(ECSDeltaReader *r, size_t size) {
+    uint64_t value = ecs_delta_get_varint(r);
+    if(value > size) r->ok = false;
+    return r->ok ? (size_t)value : 0;
+}
+
+bool ecs_delta_apply(ECSWorld *w, const void *data, size_t size) {
+    ECSDeltaReader r = { .at = data, .end = (const unsigned char*)data + size, .ok = size >= 4 };
+    if(!r.ok || memcmp(r.at, ECS_DELTA_MAGIC, 4) != 0) return false;
+    r.at += 4;
+    if(ecs_delta_get_varint(&r) != ECS_DELTA_VERSION) return false;
+    uint32_t tick = (uint32_t)ecs_delta_get_varint(&r);
+    size_t components = (size_t)ecs_delta_get_varint(&r);
+    if(!r.ok || components != ecs_components.count) return false;
+    size_t scratch_size = 1;
+    for(size_t c = 0; c < components; ++c) {
+        if(ecs_delta_get_varint(&r) != ecs_components.items[c].size) return false;
+        if(scratch_size < ecs_components.items[c].size) scratch_size = ecs_components.items[c].size;
+    }
+    uint64_t entity_count = ecs_delta_get_varint(&r);
+    if(!r.ok || entity_count > (uint64_t)ECS_ENTITY_INDEX_MASK + 1) return false;
+    w->tick = tick;
+
+    // new slots start out dead and get their real id right below
+    ecs_da_reserve_with(w->allocator, &w->entities, entity_count);
+    while(w->entities.count < entity_count) {
+        ECSEntity e = { .id = ecs_entity_make_id(w->entities.count, 0) | ECS_ENTITY_DEAD };
+#ifdef ECS_ARCHETYPES
+        e.archetype = ECS_NO_ARCHETYPE;
+#endif
+        w->entities.items[w->entities.count++] = e;
+    }
+    for(size_t index; (index = ecs_delta_get_index(&r, w->entities.count)) != 0;) {
+        ECSEntity *e = &w->entities.items[index - 1];
+        ECSEntityId id = ecs_delta_get_varint(&r);
+        ECSEntityMask mask;
+        for(size_t k = 0; k < ECS_MASK_WORDS; ++k) {
+            mask.words[k] = ecs_delta_get_varint(&r);
+            // bits past the registered components would make get_* index past ecs_components
+            size_t first = k * 64;
+            uint64_t registered = components <= first ? 0 : components - first >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << (components - first)) - 1;
+            if(mask.words[k] & ~registered) r.ok = false;
+        }
+        if(!r.ok || ecs_entity_index(id) != index - 1) return false;
+        if((id & ECS_ENTITY_DEAD) && !ecs_mask_is_empty(&mask)) return false;
+        if(!(e->id & ECS_ENTITY_DEAD) && e->id != id) {
+            // not a despawn: the sender's slots say which children died with it, and the free
+            // list comes from the sender as well
+            ecs_entity_emit_removes(w, e);
+            ecs_hierarchy_detach(w, (uint32_t)(index - 1));
+            ecs_entity_free_slot(w, e);
+        }
+        if((e->id & ECS_ENTITY_DEAD) && !(id & ECS_ENTITY_DEAD)) {
+            e->mask = (ECSEntityMask){0};
+#ifdef ECS_ARCHETYPES
+            e->archetype = ecs_archetype_root(w);
+            e->row = ecs_archetype_push(w, e->archetype, id);
+#endif
+        }
+        e->id = id;
+        // added components arrive with their values, added tags only have the mask
+        for(size_t k = 0; k < ECS_MASK_WORDS; ++k) {
+            for(uint64_t bits = e->mask.words[k] & ~mask.words[k]; bits != 0; bits &= bits - 1) {
+                ecs_component_remove(w, e, k * 64 + (size_t)__builtin_ctzll(bits));
+            }
+            for(uint64_t bits = mask.words[k] & ~e->mask.words[k] & ecs_tags.words[k]; bits != 0; bits &= bits - 1) {
+                ecs_component_add(w, e, k * 64 + (size_t)__builtin_ctzll(bits), NULL);
+            }
+        }
+    }
+
+    size_t dead = ecs_delta_get_index(&r, w->entities.count + 1);
+    if(dead != 0) {
+        w->dead_entities.count = 0;
+        ecs_da_reserve_with(w->allocator, &w->dead_entities, dead - 1);
+        for(size_t i = 0; i + 1 < dead; ++i) {
+            uint64_t index = ecs_delta_get_varint(&r);
+            if(index >= w->entities.count || !(w->entities.items[index].id & ECS_ENTITY_DEAD)) r.ok = false;
+            if(!r.ok) return false;
+            w->dead_entities.items[w->dead_entities.count++] = index;
+        }
+    }
+
+    unsigned char *scratch = ecs_mem_alloc(w->allocator, scratch_size);
+    ECS_ASSERT(scratch != NULL && "Buy more RAM lol");
+    for(size_t c; r.ok && (c = ecs_delta_get_index(&r, components)) != 0;) {
+        size_t component = c - 1, value_size = ecs_components.items[component].size;
+        for(size_t index; r.ok && (index = ecs_delta_get_index(&r, w->entities.count)) != 0;) {
+            ECSEntity *e = &w->entities.items[index - 1];
+            if(e->id & ECS_ENTITY_DEAD) r.ok = false;
+            if(!r.ok) break;
+            void *old = ecs_mask_test(&e->mask, component) ? ecs_component_get(w, e, component) : NULL;
+            if(old != NULL) memcpy(scratch, old, value_size);
+            else memset(scratch, 0, value_size);
+            for(size_t at = 0; r.ok && at < value_size;) {
+                uint64_t zeros = ecs_delta_get_varint(&r), changed = ecs_delta_get_varint(&r);
+                if(!r.ok || zeros > value_size - at || changed > value_size - at - zeros || changed > (size_t)(r.end - r.at)) {
+                    r.ok = false;
+                    break;
+                }
+                at += zeros;
+                for(size_t k = 0; k < changed; ++k) scratch[at++] ^= *r.at++;
+            }
+            if(r.ok) ecs_component_set(w, e, component, scratch);
+        }
+    }
+    ecs_mem_free(w->allocator, scratch, scratch_size);
+    return r.ok && r.at == r.end;
+}
+
+void ecs_delta_free(ECSDelta *delta) {
+    ecs_da_free_with(delta->allocator, delta);
+    *delta = (ECSDelta){ .allocator = delta->allocator };
+}
+
+// ----------------------
+// Hierarchy
+// ----------------------
+static ECSHierarchyNode* ecs_hierarchy_node(ECSWorld *w, size_t index) {
+    ECSHierarchyNodes *nodes = &w->hierarchy.nodes;
+    if(index >= nodes->count) {
+        ecs_da_reserve_with(w->allocator, nodes, index + 1);
+        for(; nodes->count <= index; nodes->count++) {
+            nodes->items[nodes->count] = (ECSHierarchyNode){
+                .parent = ECS_HIERARCHY_NONE,
+                .first_child = ECS_HIERARCHY_NONE,
+                .last_child = ECS_HIERARCHY_NONE,
+                .prev_sibling = ECS_HIERARCHY_NONE,
+                .next_sibling = ECS_HIERARCHY_NONE,
+                .slot = ECS_HIERARCHY_NONE,
+            };
+        }
+    }
+    return &nodes->items[index];
+}
+
+static void ecs_hierarchy_dirty(ECSWorld *w, uint32_t index) {
+    ECSHierarchyNode *node = ecs_hierarchy_node(w, index);
+    if(node->dirty) return;
+    node->dirty = true;
+    ecs_da_append_with(w->allocator, &w->hierarchy.dirty, index);
+}
+
+static void ecs_hierarchy_unlink(ECSWorld *w, uint32_t index) {
+    ECSHierarchyNode *nodes = w->hierarchy.nodes.items, *node = &nodes[index];
+    if(node->parent == ECS_HIERARCHY_NONE) return;
+    ECSHierarchyNode *parent = &nodes[node->parent];
+    if(node->prev_sibling != ECS_HIERARCHY_NONE) nodes[node->prev_sibling].next_sibling = node->next_sibling;
+    else parent->first_child = node->next_sibling;
+    if(node->next_sibling != ECS_HIERARCHY_NONE) nodes[node->next_sibling].prev_sibling = node->prev_sibling;
+    else parent->last_child = node->prev_sibling;
+    node->parent = node->prev_sibling = node->next_sibling = ECS_HIERARCHY_NONE;
+    w->hierarchy.stale = true;
+}
+
+// `parent` NULL makes `child` a root again
+void ecs_set_parent(ECSWorld *w, ECSEntity *child, ECSEntity *parent) {
+    uint32_t index = (uint32_t)ecs_entity_index(child->id);
+    ecs_hierarchy_node(w, index);
+    ecs_hierarchy_unlink(w, index);
+    ecs_hierarchy_dirty(w, index);
+    w->hierarchy.stale = true;
+    if(parent == NULL) return;
+    uint32_t parent_index = (uint32_t)ecs_entity_index(parent->id);
+    ecs_hierarchy_node(w, parent_index);
+    ECSHierarchyNode *nodes = w->hierarchy.nodes.items;
+    for(uint32_t up = parent_index; up != ECS_HIERARCHY_NONE; up = nodes[up].parent) {
+        ECS_ASSERT(up != index && "An entity can't be its own ancestor");
+    }
+    ECSHierarchyNode *node = &nodes[index], *p = &nodes[parent_index];
+    node->parent = parent_index;
+    node->prev_sibling = p->last_child;
+    if(p->last_child != ECS_HIERARCHY_NONE) nodes[p->last_child].next_sibling = index;
+    else p->first_child = index;
+    p->last_child = index;
+}
+
+static ECSEntity* ecs_hierarchy_entity(ECSWorld *w, uint32_t index) {
+    return index == ECS_HIERARCHY_NONE ? NULL : &w->entities.items[index];
+}
+
+ECSEntity* ecs_get_parent(ECSWorld *w, ECSEntity *e) {
+    size_t index = ecs_entity_index(e->id);
+    return index < w->hierarchy.nodes.count ? ecs_hierarchy_entity(w, w->hierarchy.nodes.items[index].parent) : NULL;
+}
+
+ECSEntity* ecs_first_child(ECSWorld *w, ECSEntity *e) {
+    size_t index = ecs_entity_index(e->id);
+    return index < w->hierarchy.nodes.count ? ecs_hierarchy_entity(w, w->hierarchy.nodes.items[index].first_child) : NULL;
+}
+
+ECSEntity* ecs_next_sibling(ECSWorld *w, ECSEntity *e) {
+    size_t index = ecs_entity_index(e->id);
+    return index < w->hierarchy.nodes.count ? ecs_hierarchy_entity(w, w->hierarchy.nodes.items[index].next_sibling) : NULL;
+}
+
+// The subtree of `e` is visited by the next ecs_hierarchy_propagate()
+void ecs_hierarchy_mark(ECSWorld *w, ECSEntity *e) {
+    ecs_hierarchy_dirty(w, (uint32_t)ecs_entity_index(e->id));
+}
+
+static void ecs_hierarchy_despawn_children(ECSWorld *w, uint32_t index) {
+    if(index >= w->hierarchy.nodes.count) return;
+    for(uint32_t child; (child = w->hierarchy.nodes.items[index].first_child) != ECS_HIERARCHY_NONE;) {
+        ecs_hierarchy_unlink(w, child);
+        ecs_despawn_entity(w, &w->entities.items[child]);
+    }
+}
+
+// Despawns the children of a dying entity and takes it out of its parent
+static void ecs_hierarchy_release(ECSWorld *w, uint32_t index) {
+    if(index >= w->hierarchy.nodes.count) return;
+    ecs_hierarchy_despawn_children(w, index);
+    ecs_hierarchy_unlink(w, index);
+    w->hierarchy.nodes.items[index].dirty = false;
+}
+
+// Takes a dying entity out of its parent and leaves its children as roots
+static void ecs_hierarchy_detach(ECSWorld *w, uint32_t index) {
+    if(index >= w->hierarchy.nodes.count) return;
+    for(uint32_t child; (child = w->hierarchy.nodes.items[index].first_child) != ECS_HIERARCHY_NONE;) {
+        ecs_hierarchy_unlink(w, child);
+        ecs_hierarchy_dirty(w, child);
+    }
+    ecs_hierarchy_unlink(w, index);
+    w->hierarchy.nodes.items[index].dirty = false;
+}
+
+static void ecs_hierarchy_rebuild(ECSWorld *w) {
+    ECSHierarchy *h = &w->hierarchy;
+    h->order.count = 0;
+    for(size_t i = 0; i < h->nodes.count; ++i) h->nodes.items[i].slot = ECS_HIERARCHY_NONE;
+    for(size_t i = 0; i < h->nodes.count; ++i) {
+        ECSHierarchyNode *node = &h->nodes.items[i];
+        if(node->parent != ECS_HIERARCHY_NONE || node->first_child == ECS_HIERARCHY_NONE) continue;
+        ECSHierarchyEntry root = { .entity = (uint32_t)i, .parent = ECS_HIERARCHY_NONE };
+        node->slot = (uint32_t)h->order.count;
+        ecs_da_append_with(w->allocator, &h->order, root);
+        // the whole tree goes in before the next root
+        for(size_t slot = node->slot; slot < h->order.count; ++slot) {
+            uint32_t first_child = (uint32_t)h->order.count;
+            for(uint32_t c = h->nodes.items[h->order.items[slot].entity].first_child; c != ECS_HIERARCHY_NONE; c = h->nodes.items[c].next_sibling) {
+                ECSHierarchyEntry entry = { .entity = c, .parent = (uint32_t)slot };
+                h->nodes.items[c].slot = (uint32_t)h->order.count;
+                ecs_da_append_with(w->allocator, &h->order, entry);
+            }
+            h->order.items[slot].first_child = first_child;
+            h->order.items[slot].child_count = (uint32_t)h->order.count - first_child;
+        }
+    }
+    h->stale = false;
+}
+
+// Calls `fn` for every entity below (and including) the dirty ones, parents first. An entity is
+// dirty when it was marked, was reparented, or `component` was written at `since` or later.
+// Pass ECS_NO_COMPONENT to go by the marks only. Only the subtrees of the dirty entities are
+// walked, a dirty entity below another one is covered by the walk of its ancestor.
+void ecs_hierarchy_propagate(ECSWorld *w, size_t component, uint32_t since, ECSHierarchyFn fn, void *ctx) {
+    ECSHierarchy *h = &w->hierarchy;
+    if(h->stale) ecs_hierarchy_rebuild(w);
+    if(component != ECS_NO_COMPONENT) {
+        size_t term = component | ECS_TERM_CHANGED;
+        for(ECSFilterIter it = ecs_filter_iter(w, ecs_filter_of(&term, 1, since)); ecs_filter_iter_next(&it);) {
+            size_t index = ecs_entity_index(it.entity->id);
+            if(index < h->nodes.count && h->nodes.items[index].slot != ECS_HIERARCHY_NONE) ecs_hierarchy_dirty(w, (uint32_t)index);
+        }
+    }
+    for(size_t i = 0; i < h->dirty.count; ++i) {
+        ECSHierarchyNode *nodes = h->nodes.items, *node = &nodes[h->dirty.items[i]];
+        if(!node->dirty) continue;
+        if(node->slot == ECS_HIERARCHY_NONE) {
+            node->dirty = false;
+            continue;
+        }
+        bool covered = false;
+        for(uint32_t up = node->parent; up != ECS_HIERARCHY_NONE && !covered; up = nodes[up].parent) covered = nodes[up].dirty;
+        if(covered) continue;
+        h->visits.count = 0;
+        ecs_da_append_with(w->allocator, &h->visits, node->slot);
+        for(size_t k = 0; k < h->visits.count; ++k) {
+            ECSHierarchyEntry entry = h->order.items[h->visits.items[k]];
+            uint32_t parent = h->nodes.items[entry.entity].parent;
+            h->nodes.items[entry.entity].dirty = false;
+            fn(w, &w->entities.items[entry.entity], parent == ECS_HIERARCHY_NONE ? NULL : &w->entities.items[parent], ctx);
+            ecs_da_reserve_with(w->allocator, &h->visits, h->visits.count + entry.child_count);
+            for(uint32_t c = 0; c < entry.child_count; ++c) h->visits.items[h->visits.count++] = entry.first_child + c;
+        }
+    }
+    h->dirty.count = 0;
+}
+
+// ----------------------
+// Spatial index
+// ----------------------
+// Clamped to the int32 range before the cast, which would be undefined outside of it. NaN has no
+// cell, query bounds are checked for it before getting here.
+static int32_t ecs_spatial_cell(const ECSSpatialIndex *index, float v) {
+    float f = v / index->cell_size;
+    ECS_ASSERT(f == f && "NaN coordinate");
+    if(f <= (float)INT32_MIN) return INT32_MIN;
+    if(f >= (float)INT32_MAX) return INT32_MAX;
+    int32_t c = (int32_t)f;
+    return (float)c > f ? c - 1 : c;
+}
+
+static size_t ecs_spatial_hash(int32_t x, int32_t y) {
+    uint64_t h = (uint64_t)(uint32_t)x * 0x9E3779B97F4A7C15ull ^ (uint64_t)(uint32_t)y * 0xC2B2AE3D27D4EB4Full;
+    return (size_t)(h ^ (h >> 29));
+}
+
+static ECSSpatialCell* ecs_spatial_lookup(ECSSpatialIndex *index, int32_t x, int32_t y, bool create);
+
+// Grows the table, cells that went empty are dropped on the way
+static void ecs_spatial_rehash(ECSSpatialIndex *index, size_t capacity) {
+    ECSSpatialCell *old = index->cells;
+    size_t old_capacity = index->cell_capacity;
+    index->cells = ecs_mem_alloc(index->world->allocator, capacity * sizeof(ECSSpatialCell));
+    ECS_ASSERT(index->cells != NULL && "Buy more RAM lol");
+    memset(index->cells, 0, capacity * sizeof(ECSSpatialCell));
+    index->cell_capacity = capacity;
+    index->cell_count = 0;
+    for(size_t i = 0; i < old_capacity; ++i) {
+        if(old[i].used && old[i].head != ECS_SPATIAL_NONE) ecs_spatial_lookup(index, old[i].x, old[i].y, true)->head = old[i].head;
+    }
+    ecs_mem_free(index->world->allocator, old, old_capacity * sizeof(ECSSpatialCell));
+}
+
+static ECSSpatialCell* ecs_spatial_lookup(ECSSpatialIndex *index, int32_t x, int32_t y, bool create) {
+    if(create && (index->cell_count + 1) * 2 > index->cell_capacity) {
+        ecs_spatial_rehash(index, index->cell_capacity ? index->cell_capacity * 2 : 64);
+    }
+    if(index->cell_capacity == 0) return NULL;
+    size_t mask = index->cell_capacity - 1;
+    for(size_t i = ecs_spatial_hash(x, y) & mask;; i = (i + 1) & mask) {
+        ECSSpatialCell *cell = &index->cells[i];
+        if(!cell->used) {
+            if(!create) return NULL;
+            *cell = (ECSSpatialCell){ .x = x, .y = y, .head = ECS_SPATIAL_NONE, .used = true };
+            index->cell_count++;
+            return cell;
+        }
+        if(cell->x == x && cell->y == y) return cell;
+    }
+}
+
+static void ecs_spatial_unlink(ECSSpatialIndex *index, uint32_t i) {
+    ECSSpatialNode *node = &index->nodes.items[i];
+    if(node->prev != ECS_SPATIAL_NONE) index->nodes.items[node->prev].next = node->next;
+    else ecs_spatial_lookup(index, node->cell_x, node->cell_y, false)->head = node->next;
+    if(node->next != ECS_SPATIAL_NONE) index->nodes.items[node->next].prev = node->prev;
+    node->present = false;
+}
+
+static void ecs_spatial_update(ECSSpatialIndex *index, ECSEntity *e) {
+    size_t i = ecs_entity_index(e->id);
+    if(i >= index->nodes.count) {
+        ecs_da_reserve_with(index->world->allocator, &index->nodes, i + 1);
+        memset(index->nodes.items + index->nodes.count, 0, (i + 1 - index->nodes.count) * sizeof(ECSSpatialNode));
+        index->nodes.count = i + 1;
+    }
+    float x, y;
+    index->position(ecs_component_get(index->world, e, index->component), &x, &y);
+    int32_t cell_x = ecs_spatial_cell(index, x), cell_y = ecs_spatial_cell(index, y);
+    ECSSpatialNode *node = &index->nodes.items[i];
+    if(!node->present || node->cell_x != cell_x || node->cell_y != cell_y) {
+        if(node->present) ecs_spatial_unlink(index, (uint32_t)i);
+        ECSSpatialCell *cell = ecs_spatial_lookup(index, cell_x, cell_y, true);
+        node = &index->nodes.items[i];
+        *node = (ECSSpatialNode){ .cell_x = cell_x, .cell_y = cell_y, .prev = ECS_SPATIAL_NONE, .next = cell->head, .present = true };
+        if(cell->head != ECS_SPATIAL_NONE) index->nodes.items[cell->head].prev = (uint32_t)i;
+        cell->head = (uint32_t)i;
+    }
+    node->x = x;
+    node->y = y;
+}
+
+static void ecs_spatial_on_set(ECSWorld *w, size_t component, const ECSEntityId *ids, size_t count, void *ctx) {
+    (void)component;
+    for(size_t i = 0; i < count; ++i) ecs_spatial_update(ctx, ecs_get_entity_with_id(w, ids[i]));
+}
+
+static void ecs_spatial_on_remove(ECSWorld *w, size_t component, const ECSEntityId *ids, size_t count, void *ctx) {
+    (void)w; (void)component;
+    ECSSpatialIndex *index = ctx;
+    for(size_t i = 0; i < count; ++i) {
+        size_t n = ecs_entity_index(ids[i]);
+        if(n < index->nodes.count && index->nodes.items[n].present) ecs_spatial_unlink(index, (uint32_t)n);
+    }
+}
+
+void ecs_spatial_init(ECSSpatialIndex *index, ECSWorld *w, size_t component, float cell_size, ECSSpatialPositionFn position) {
+    ECS_ASSERT(cell_size > 0 && "Cell size has to be positive");
+    *index = (ECSSpatialIndex){
+        .world = w,
+        .component = component,
+        .cell_size = cell_size,
+        .position = position,
+        .since = w->tick,
+    };
+    QueryByComponents(w, e, component) ecs_spatial_update(index, e);
+    // adding a value raises ECS_ON_SET as well, so that covers both
+    ecs_observe(w, component, ECS_ON_SET, ecs_spatial_on_set, index);
+    ecs_observe(w, component, ECS_ON_REMOVE, ecs_spatial_on_remove, index);
+}
+
+void ecs_spatial_sync(ECSSpatialIndex *index) {
+    static bool warned = false;
+    if(index->synced && index->since == index->world->tick && !warned) {
+        printf("[WARN] ecs_spatial_sync() ran twice at tick %u, call ecs_world_advance_tick() in between\n", (unsigned)index->since);
+        warned = true;
+    }
+    index->synced = true;
+    QueryFiltered(index->world, e, index->since, index->component | ECS_TERM_CHANGED) ecs_spatial_update(index, e);
+    index->since = index->world->tick;
+}
+
+void ecs_spatial_free(ECSSpatialIndex *index) {
+    ecs_unobserve(index->world, index->component, ECS_ON_SET, ecs_spatial_on_set, index);
+    ecs_unobserve(index->world, index->component, ECS_ON_REMOVE, ecs_spatial_on_remove, index);
+    ecs_da_free_with(index->world->allocator, &index->nodes);
+    ecs_mem_free(index->world->allocator, index->cells, index->cell_capacity * sizeof(ECSSpatialCell));
+    *index = (ECSSpatialIndex){0};
+}
+
+ECSSpatialIter ecs_spatial_aabb(ECSSpatialIndex *index, float min_x, float min_y, float max_x, float max_y) {
+    ECSSpatialIter it = {
+        .index = index,
+        .min_x = min_x, .min_y = min_y, .max_x = max_x, .max_y = max_y,
+        .node = ECS_SPATIAL_NONE,
+        .keep = true,
+    };
+    // NaN bounds match nothing
+    if(min_x != min_x || min_y != min_y || max_x != max_x || max_y != max_y) {
+        it.done = true;
+        return it;
+    }
+    it.cell_min_x = ecs_spatial_cell(index, min_x);
+    it.cell_min_y = ecs_spatial_cell(index, min_y);
+    it.cell_max_x = ecs_spatial_cell(index, max_x);
+    it.cell_max_y = ecs_spatial_cell(index, max_y);
+    it.cell_x = it.cell_min_x;
+    it.cell_y = it.cell_min_y;
+    double cells = ((double)it.cell_max_x - it.cell_min_x + 1) * ((double)it.cell_max_y - it.cell_min_y + 1);
+    it.scan = cells > (double)index->cell_capacity;
+    it.done = min_x > max_x || min_y > max_y;
+    return it;
+}
+
+ECSSpatialIter ecs_spatial_radius(ECSSpatialIndex *index, float x, float y, float radius) {
+    ECSSpatialIter it = ecs_spatial_aabb(index, x - radius, y - radius, x + radius, y + radius);
+    it.center_x = x;
+    it.center_y = y;
+    it.radius2 = radius * radius;
+    it.round = true;
+    return it;
+}
+
+bool ecs_spatial_iter_next(ECSSpatialIter *it) {
+    ECSSpatialIndex *index = it->index;
+    for(;;) {
+        while(it->node != ECS_SPATIAL_NONE) {
+            uint32_t i = it->node;
+            ECSSpatialNode *node = &index->nodes.items[i];
+            it->node = node->next;
+            if(node->x < it->min_x || node->x > it->max_x || node->y < it->min_y || node->y > it->max_y) continue;
+            if(it->round) {
+                float dx = node->x - it->center_x, dy = node->y - it->center_y;
+                if(dx * dx + dy * dy > it->radius2) continue;
+            }
+            it->entity = &index->world->entities.items[i];
+            return true;
+        }
+        if(it->done) return false;
+        if(it->scan) {
+            if(it->slot >= index->cell_capacity) return false;
+            ECSSpatialCell *cell = &index->cells[it->slot++];
+            if(cell->used && cell->x >= it->cell_min_x && cell->x <= it->cell_max_x && cell->y >= it->cell_min_y && cell->y <= it->cell_max_y) {
+                it->node = cell->head;
+            }
+            continue;
+        }
+        ECSSpatialCell *cell = ecs_spatial_lookup(index, it->cell_x, it->cell_y, false);
+        if(cell != NULL) it->node = cell->head;
+        // INT32_MAX bounds would wrap, so the rows are stepped with explicit checks
+        if(it->cell_x < it->cell_max_x) {
+            it->cell_x++;
+        } else if(it->cell_y < it->cell_max_y) {
+            it->cell_x = it->cell_min_x;
+            it->cell_y++;
+        } else {
+            it->done = true;
+        }
+    }
+}
+
+static size_t* ecs_sparse_slot(ECSSparseSet *set, ECSEntityId id, bool create) {
+    size_t index = ecs_entity_index(id);
+    size_t page = index / ECS_SPARSE_PAGE_SIZE;
+    if(page >= set->sparse.count) {
+        if(!create) return NULL;
+        ecs_da_reserve_with(set->allocator, &set->sparse, page + 1);
+        memset(set->sparse.items + set->sparse.count, 0, (page + 1 - set->sparse.count) * sizeof(*set->sparse.items));
+        set->sparse.count = page + 1;
+    }
+    if(set->sparse.items[page] == NULL) {
+        if(!create) return NULL;
+        set->sparse.items[page] = ecs_mem_alloc(set->allocator, ECS_SPARSE_PAGE_SIZE * sizeof(size_t));
+        ECS_ASSERT(set->sparse.items[page] != NULL && "Buy more RAM lol");
+        memset(set->sparse.items[page], 0xFF, ECS_SPARSE_PAGE_SIZE * sizeof(size_t));
+    }
+    return &set->sparse.items[page][index % ECS_SPARSE_PAGE_SIZE];
+}
+
+bool ecs_sparse_contains(ECSSparseSet *set, ECSEntityId id) {
+    size_t *slot = ecs_sparse_slot(set, id, false);
+    return slot != NULL && *slot != ECS_SPARSE_NONE && set->dense.items[*slot] == id;
+}
+
+void* ecs_sparse_get(ECSSparseSet *set, ECSEntityId id) {
+    size_t *slot = ecs_sparse_slot(set, id, false);
+    if(slot == NULL || *slot == ECS_SPARSE_NONE || set->dense.items[*slot] != id) return NULL;
+    return set->data + *slot * set->size;
+}
+
+void ecs_sparse_reserve(ECSSparseSet *set, size_t count) {
+    size_t old_capacity = set->dense.capacity;
+    if(count <= old_capacity) return;
+    size_t capacity = old_capacity > 0 ? old_capacity : set->initial_capacity > 0 ? set->initial_capacity : ECS_DA_INIT_CAP;
+    float growth = set->growth > 1.0f ? set->growth : 2.0f;
+    while(capacity < count) {
+        size_t next = (size_t)((double)capacity * growth);
+        capacity = next > capacity ? next : capacity + 1;
+    }
+    set->dense.items = ecs_mem_realloc(set->allocator, set->dense.items, old_capacity * sizeof(ECSEntityId), capacity * sizeof(ECSEntityId));
+    ECS_ASSERT(set->dense.items != NULL && "Buy more RAM lol");
+    set->dense.capacity = capacity;
+    if(set->borrowed) {
+        unsigned char *data = ecs_mem_alloc(set->allocator, set->dense.capacity * set->size);
+        ECS_ASSERT(data != NULL && "Buy more RAM lol");
+        memcpy(data, set->data, set->dense.count * set->size);
+        set->data = data;
+        set->borrowed = false;
+    } else if(set->size > 0) {
+        set->data = ecs_mem_realloc(set->allocator, set->data, old_capacity * set->size, set->dense.capacity * set->size);
+        ECS_ASSERT(set->data != NULL && "Buy more RAM lol");
+    }
+    if(set->tracked) {
+        size_t old_blocks = (old_capacity + ECS_TICK_BLOCK - 1) / ECS_TICK_BLOCK;
+        size_t blocks = (set->dense.capacity + ECS_TICK_BLOCK - 1) / ECS_TICK_BLOCK;
+        set->ticks = ecs_mem_realloc(set->allocator, set->ticks, old_capacity * sizeof(ECSTicks), set->dense.capacity * sizeof(ECSTicks));
+        set->block_ticks = ecs_mem_realloc(set->allocator, set->block_ticks, old_blocks * sizeof(ECSTicks), blocks * sizeof(ECSTicks));
+        ECS_ASSERT(set->ticks != NULL && set->block_ticks != NULL && "Buy more RAM lol");
+        memset(set->block_ticks + old_blocks, 0, (blocks - old_blocks) * sizeof(ECSTicks));
+    }
+}
+
+void* ecs_sparse_insert(ECSSparseSet *set, ECSEntityId id, const void *value) {
+    size_t *slot = ecs_sparse_slot(set, id, true);
+    if(*slot == ECS_SPARSE_NONE) {
+        ecs_sparse_reserve(set, set->dense.count + 1);
+        *slot = set->dense.count;
+        set->dense.items[set->dense.count++] = id;
+    }
+    // the slot may still be owned by an older generation of the same index
+    set->dense.items[*slot] = id;
+    if(set->size == 0) return NULL;
+    void *dst = set->data + *slot * set->size;
+    memcpy(dst, value, set->size);
+    return dst;
+}
+
+// O(1): the last value is moved into the hole and its owner's slot is pointed at it
+bool ecs_sparse_remove(ECSSparseSet *set, ECSEntityId id) {
+    size_t *slot = ecs_sparse_slot(set, id, false);
+    if(slot == NULL || *slot == ECS_SPARSE_NONE || set->dense.items[*slot] != id) return false;
+    size_t index = *slot;
+    size_t last = set->dense.count - 1;
+    if(index != last) {
+        ECSEntityId moved = set->dense.items[last];
+        if(set->size > 0) memcpy(set->data + index * set->size, set->data + last * set->size, set->size);
+        if(set->tracked) {
+            // the block keeps the newest ticks it ever saw, which may now be stale but never too old
+            ECSTicks *block = &set->block_ticks[index / ECS_TICK_BLOCK];
+            for(size_t k = 0; k < 2; ++k) {
+                set->ticks[index][k] = set->ticks[last][k];
+                if((*block)[k] < set->ticks[index][k]) (*block)[k] = set->ticks[index][k];
+            }
+        }
+        *ecs_sparse_slot(set, moved, false) = index;
+    }
+    ecs_da_remove_unordered(&set->dense, index);
+    *slot = ECS_SPARSE_NONE;
+    return true;
+}
+
+ECSEntityId ecs_sparse_entity_of(ECSSparseSet *set, const void *value) {
+    size_t index = set->size ? (size_t)((const unsigned char*)value - set->data) / set->size : 0;
+    ECS_ASSERT(index < set->dense.count);
+    return set->dense.items[index];
+}
+
+void ecs_sparse_free(ECSSparseSet *set) {
+    ecs_da_foreach(size_t*, page, &set->sparse) {
+        ecs_mem_free(set->allocator, *page, ECS_SPARSE_PAGE_SIZE * sizeof(size_t));
+    }
+    ecs_da_free_with(set->allocator, &set->sparse);
+    ecs_da_free_with(set->allocator, &set->dense);
+    if(!set->borrowed) ecs_mem_free(set->allocator, set->data, set->dense.capacity * set->size);
+    ecs_mem_free(set->allocator, set->ticks, set->dense.capacity * sizeof(ECSTicks));
+    ecs_mem_free(set->allocator, set->block_ticks, (set->dense.capacity + ECS_TICK_BLOCK - 1) / ECS_TICK_BLOCK * sizeof(ECSTicks));
+    *set = (ECSSparseSet){
+        .size = set->size,
+        .allocator = set->allocator,
+        .tracked = set->tracked,
+        .initial_capacity = set->initial_capacity,
+        .growth = set->growth,
+    };
+}
+
+void* ecs_mem_alloc(const ECSAllocator *allocator, size_t size) {
+    return ecs_mem_realloc(allocator, NULL, 0, size);
+}
+
+void* ecs_mem_realloc(const ECSAllocator *allocator, void *ptr, size_t old_size, size_t new_size) {
+    if(allocator == NULL) return ECS_REALLOC(ptr, new_size);
+    if(ptr == NULL) return allocator->alloc(allocator->ctx, new_size);
+    return allocator->realloc(allocator->ctx, ptr, old_size, new_size);
+}
+
+void ecs_mem_free(const ECSAllocator *allocator, void *ptr, size_t size) {
+    if(ptr == NULL) return;
+    if(allocator == NULL) ECS_FREE(ptr);
+    else allocator->free(allocator->ctx, ptr, size);
+}
+
+void* ecs_mem_shrink(const ECSAllocator *allocator, void *ptr, size_t old_size, size_t new_size) {
+    if(new_size == old_size) return ptr;
+    if(new_size == 0) {
+        ecs_mem_free(allocator, ptr, old_size);
+        return NULL;
+    }
+    void *result = ecs_mem_realloc(allocator, ptr, old_size, new_size);
+    ECS_ASSERT(result != NULL && "Buy more RAM lol");
+    return result;
+}
+
+void ecs_set_allocator(ECSWorld *w, const ECSAllocator *allocator) {
+    ECS_ASSERT(w->entities.capacity == 0 && w->queries.capacity == 0 && "Set the allocator before spawning entities");
+#ifndef ECS_ARCHETYPES
+    ECS_ASSERT(w->storages.capacity == 0 && "Set the allocator before adding components");
+#endif
+    w->allocator = allocator;
+}
+
+#ifdef ECS_ARCHETYPES
+void ecs_set_chunk_allocator(ECSWorld *w, const ECSAllocator *allocator) {
+    ECS_ASSERT(w->archetypes.count == 0 && "Set the chunk allocator before spawning entities");
+    w->chunk_allocator = allocator;
+}
+#else
+void ecs_component_set_allocator(ECSWorld *w, size_t component, const ECSAllocator *allocator) {
+    ECSSparseSet *set = ecs_world_storage(w, component);
+    ECS_ASSERT(set->dense.capacity == 0 && set->sparse.capacity == 0 && "Set the allocator before adding the component");
+    set->allocator = allocator;
+}
+#endif
+
+#ifndef ECS_ARCHETYPES
+void ecs_component_set_growth(ECSWorld *w, size_t component, size_t initial_capacity, float growth) {
+    ECS_ASSERT((growth == 0.0f || growth > 1.0f) && "The growth factor has to be above 1");
+    ECSSparseSet *set = ecs_world_storage(w, component);
+    set->initial_capacity = initial_capacity;
+    set->growth = growth;
+}
+
+// Everything a sparse set holds, values that live in a snapshot mapping excluded
+static size_t ecs_sparse_bytes(const ECSSparseSet *set, size_t *wasted) {
+    size_t per_value = sizeof(*set->dense.items) + (set->borrowed ? 0 : set->size) + (set->tracked ? sizeof(ECSTicks) : 0);
+    size_t pages = 0;
+    ecs_da_foreach(size_t*, page, &set->sparse) pages += *page != NULL;
+    size_t bytes = set->dense.capacity * per_value + ecs_da_bytes(&set->sparse) + pages * ECS_SPARSE_PAGE_SIZE * sizeof(size_t);
+    if(set->tracked) bytes += (set->dense.capacity + ECS_TICK_BLOCK - 1) / ECS_TICK_BLOCK * sizeof(ECSTicks);
+    *wasted = (set->dense.capacity - set->dense.count) * per_value
+            + (set->sparse.capacity - pages) * sizeof(size_t*)
+            + (pages * ECS_SPARSE_PAGE_SIZE - set->dense.count) * sizeof(size_t);
+    return bytes;
+}
+
+static void ecs_sparse_shrink(ECSSparseSet *set) {
+    for(size_t p = 0; p < set->sparse.count; ++p) {
+        size_t *page = set->sparse.items[p], k = 0;
+        if(page == NULL) continue;
+        while(k < ECS_SPARSE_PAGE_SIZE && page[k] == ECS_SPARSE_NONE) k++;
+        if(k < ECS_SPARSE_PAGE_SIZE) continue;
+        ecs_mem_free(set->allocator, page, ECS_SPARSE_PAGE_SIZE * sizeof(size_t));
+        set->sparse.items[p] = NULL;
+    }
+    // growing the page table again zeroes whatever is past `count`
+    while(set->sparse.count > 0 && set->sparse.items[set->sparse.count - 1] == NULL) set->sparse.count--;
+    ecs_da_shrink_with(set->allocator, &set->sparse);
+
+    size_t old_capacity = set->dense.capacity;
+    ecs_da_shrink_with(set->allocator, &set->dense);
+    size_t capacity = set->dense.capacity;
+    if(!set->borrowed) set->data = ecs_mem_shrink(set->allocator, set->data, old_capacity * set->size, capacity * set->size);
+    if(set->tracked) {
+        size_t old_blocks = (old_capacity + ECS_TICK_BLOCK - 1) / ECS_TICK_BLOCK;
+        size_t blocks = (capacity + ECS_TICK_BLOCK - 1) / ECS_TICK_BLOCK;
+        set->ticks = ecs_mem_shrink(set->allocator, set->ticks, old_capacity * sizeof(ECSTicks), capacity * sizeof(ECSTicks));
+        set->block_ticks = ecs_mem_shrink(set->allocator, set->block_ticks, old_blocks * sizeof(ECSTicks), blocks * sizeof(ECSTicks));
+    }
+}
+#endif
+
+void ecs_memory_stats(ECSWorld *w, ECSMemoryStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->component_count = ecs_components.count;
+    for(size_t c = 0; c < ecs_components.count; ++c) {
+        stats->components[c].name = ecs_components.items[c].name;
+        stats->components[c].size = ecs_components.items[c].size;
+    }
+    stats->entity_count = w->entities.count;
+    stats->entity_capacity = w->entities.capacity;
+    stats->entity_bytes = ecs_da_bytes(&w->entities);
+    stats->free_count = w->dead_entities.count;
+    stats->free_capacity = w->dead_entities.capacity;
+    stats->free_bytes = ecs_da_bytes(&w->dead_entities);
+    stats->wasted_bytes = (w->entities.capacity - w->entities.count) * sizeof(ECSEntity) +
+                          (w->dead_entities.capacity - w->dead_entities.count) * sizeof(ECSEntityId);
+    stats->other_bytes = ecs_da_bytes(&w->queries) + ecs_da_bytes(&w->observers) + ecs_da_bytes(&w->hierarchy.nodes) +
+                         ecs_da_bytes(&w->hierarchy.order) + ecs_da_bytes(&w->hierarchy.dirty) + ecs_da_bytes(&w->hierarchy.visits) +
+                         ecs_da_bytes(&w->resources);
+    for(size_t r = 0; r < w->resources.count; ++r) {
+        if(w->resources.items[r] != NULL) stats->other_bytes += ecs_components.items[r].size;
+    }
+    size_t component_bytes = 0;
+#ifndef ECS_ARCHETYPES
+    for(size_t c = 0; c < w->storages.count; ++c) {
+        ECSSparseSet *set = &w->storages.items[c];
+        ECSComponentMemory *m = &stats->components[c];
+        m->count = set->dense.count;
+        m->capacity = set->dense.capacity;
+        m->bytes = ecs_sparse_bytes(set, &m->wasted);
+        component_bytes += m->bytes;
+        stats->wasted_bytes += m->wasted;
+    }
+    stats->other_bytes += ecs_da_bytes(&w->storages);
+    ecs_da_foreach(ECSQuery*, it, &w->queries) {
+        size_t wasted;
+        stats->other_bytes += sizeof(ECSQuery) + ecs_sparse_bytes(&(*it)->matches, &wasted);
+        stats->wasted_bytes += wasted;
+    }
+    stats->snapshot_bytes = w->snapshot_size;
+#else
+    ecs_da_foreach(ECSArchetype, a, &w->archetypes) {
+        size_t capacity = a->chunks.count * a->chunk_capacity;
+        stats->chunk_bytes += a->chunks.count * (a->chunk_size + ECS_CHUNK_COLUMN_ALIGN);
+        stats->wasted_bytes += (capacity - a->count) * (a->chunk_size / a->chunk_capacity);
+        stats->other_bytes += ecs_da_bytes(&a->chunks) + ecs_da_bytes(&a->edges) + 3 * (a->component_count + 1) * sizeof(size_t);
+        for(size_t col = 0; col < a->component_count; ++col) {
+            ECSComponentMemory *m = &stats->components[a->components[col]];
+            size_t per_value = m->size + sizeof(ECSTicks);
+            m->count += a->count;
+            m->capacity += capacity;
+            m->bytes += capacity * per_value;
+            m->wasted += (capacity - a->count) * per_value;
+        }
+    }
+    stats->other_bytes += ecs_da_bytes(&w->archetypes) + w->archetype_slot_capacity * sizeof(size_t);
+    ecs_da_foreach(ECSQuery*, it, &w->queries) {
+        stats->other_bytes += sizeof(ECSQuery) + ecs_da_bytes(&(*it)->archetypes);
+    }
+    component_bytes = stats->chunk_bytes;
+#endif
+    stats->total_bytes = stats->entity_bytes + stats->free_bytes + component_bytes + stats->snapshot_bytes + stats->other_bytes;
+}
+
+void ecs_memory_report(const ECSMemoryStats *stats, FILE *out) {
+    fprintf(out, "%-24s %6s %10s %10s %12s %12s\n", "component", "size", "count", "capacity", "bytes", "wasted");
+    for(size_t c = 0; c < stats->component_count; ++c) {
+        const ECSComponentMemory *m = &stats->components[c];
+        fprintf(out, "%-24s %6zu %10zu %10zu %12zu %12zu\n", m->name, m->size, m->count, m->capacity, m->bytes, m->wasted);
+    }
+    fprintf(out, "%-24s %6zu %10zu %10zu %12zu\n", "entities", sizeof(ECSEntity), stats->entity_count, stats->entity_capacity, stats->entity_bytes);
+    fprintf(out, "%-24s %6zu %10zu %10zu %12zu\n", "free list", sizeof(ECSEntityId), stats->free_count, stats->free_capacity, stats->free_bytes);
+    if(stats->chunk_bytes > 0) fprintf(out, "%-24s %41zu\n", "chunks", stats->chunk_bytes);
+    if(stats->snapshot_bytes > 0) fprintf(out, "%-24s %41zu\n", "snapshot", stats->snapshot_bytes);
+    fprintf(out, "%-24s %41zu\n", "other", stats->other_bytes);
+    fprintf(out, "%-24s %41zu %12zu\n", "total", stats->total_bytes, stats->wasted_bytes);
+}
+
+// Reallocates, so like a spawn it invalidates ECSEntity and component pointers
+void ecs_shrink_to_fit(ECSWorld *w) {
+    ecs_da_shrink_with(w->allocator, &w->entities);
+    ecs_da_shrink_with(w->allocator, &w->dead_entities);
+    ecs_da_shrink_with(w->allocator, &w->queries);
+    ecs_da_shrink_with(w->allocator, &w->observers);
+    ecs_da_shrink_with(w->allocator, &w->hierarchy.nodes);
+    ecs_da_shrink_with(w->allocator, &w->hierarchy.order);
+    ecs_da_shrink_with(w->allocator, &w->hierarchy.dirty);
+    ecs_da_shrink_with(w->allocator, &w->hierarchy.visits);
+    ecs_da_shrink_with(w->allocator, &w->resources);
+#ifndef ECS_ARCHETYPES
+    ecs_da_foreach(ECSSparseSet, it, &w->storages) {
+        ecs_sparse_shrink(it);
+    }
+    ecs_da_foreach(ECSQuery*, it, &w->queries) {
+        ecs_sparse_shrink(&(*it)->matches);
+    }
+#else
+    ecs_da_foreach(ECSArchetype, a, &w->archetypes) {
+        size_t chunks = (a->count + a->chunk_capacity - 1) / a->chunk_capacity;
+        while(a->chunks.count > chunks) {
+            ecs_chunk_free(w, a->chunks.items[--a->chunks.count], a->chunk_size);
+        }
+        ecs_da_shrink_with(w->allocator, &a->chunks);
+        ecs_da_shrink_with(w->allocator, &a->edges);
+    }
+    ecs_da_foreach(ECSQuery*, it, &w->queries) {
+        ecs_da_shrink_with(w->allocator, &(*it)->archetypes);
+    }
+#endif
+}
+
+
+void ecs_arena_init(ECSArena *arena, size_t block_size, const ECSAllocator *parent) {
+    *arena = (ECSArena){
+        .block_size = block_size,
+        .parent = parent,
+    };
+}
+
+void* ecs_arena_alloc(ECSArena *arena, size_t size) {
+    size_t header = ecs_align_up(sizeof(ECSArenaBlock), ECS_ARENA_ALIGN);
+    size = ecs_align_up(size, ECS_ARENA_ALIGN);
+    ECSArenaBlock *block = arena->current;
+    while(block != NULL && block->used + size > block->capacity) {
+        block = block->next;
+    }
+    if(block == NULL) {
+        size_t capacity = size > arena->block_size ? size : arena->block_size;
+        block = ecs_mem_alloc(arena->parent, header + capacity);
+        ECS_ASSERT(block != NULL && "Buy more RAM lol");
+        *block = (ECSArenaBlock){ .capacity = capacity };
+        // new blocks go right after the current one, the blocks past it are empty anyway
+        if(arena->current == NULL) {
+            arena->first = block;
+        } else {
+            block->next = arena->current->next;
+            arena->current->next = block;
+        }
+    }
+    arena->current = block;
+    void *ptr = (unsigned char*)block + header + block->used;
+    block->used += size;
+    arena->last = ptr;
+    return ptr;
+}
+
+void ecs_arena_reset(ECSArena *arena) {
+    for(ECSArenaBlock *block = arena->first; block != NULL; block = block->next) {
+        block->used = 0;
+    }
+    arena->current = arena->first;
+    arena->last = NULL;
+}
+
+void ecs_arena_destroy(ECSArena *arena) {
+    size_t header = ecs_align_up(sizeof(ECSArenaBlock), ECS_ARENA_ALIGN);
+    ECSArenaBlock *block = arena->first;
+    while(block != NULL) {
+        ECSArenaBlock *next = block->next;
+        ecs_mem_free(arena->parent, block, header + block->capacity);
+        block = next;
+    }
+    ecs_arena_init(arena, arena->block_size, arena->parent);
+}
+
+static void* ecs_arena_vt_alloc(void *ctx, size_t size) {
+    return ecs_arena_alloc(ctx, size);
+}
+
+static void* ecs_arena_vt_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size) {
+    ECSArena *arena = ctx;
+    ECSArenaBlock *block = arena->current;
+    if(ptr == arena->last && block != NULL) {
+        // growing the latest allocation just moves the bump pointer
+        size_t start = (size_t)((unsigned char*)ptr - (unsigned char*)block) - ecs_align_up(sizeof(ECSArenaBlock), ECS_ARENA_ALIGN);
+        size_t end = start + ecs_align_up(new_size, ECS_ARENA_ALIGN);
+        if(end <= block->capacity) {
+            block->used = end;
+            return ptr;
+        }
+    }
+    void *result = ecs_arena_alloc(arena, new_size);
+    memcpy(result, ptr, old_size < new_size ? old_size : new_size);
+    return result;
+}
+
+static void ecs_arena_vt_free(void *ctx, void *ptr, size_t size) {
+    (void)ctx; (void)ptr; (void)size;
+}
+
+ECSAllocator ecs_arena_allocator(ECSArena *arena) {
+    return (ECSAllocator){
+        .alloc = ecs_arena_vt_alloc,
+        .realloc = ecs_arena_vt_realloc,
+        .free = ecs_arena_vt_free,
+        .ctx = arena,
+    };
+}
+
+void ecs_pool_init(ECSPool *pool, size_t block_size, size_t blocks_per_slab, const ECSAllocator *parent) {
+    if(block_size < sizeof(void*)) block_size = sizeof(void*);
+    *pool = (ECSPool){
+        .block_size = ecs_align_up(block_size, ECS_ARENA_ALIGN),
+        .blocks_per_slab = blocks_per_slab > 0 ? blocks_per_slab : 1,
+        .parent = parent,
+    };
+}
+
+void* ecs_pool_alloc(ECSPool *pool, size_t size) {
+    if(size > pool->block_size) return ecs_mem_alloc(pool->parent, size);
+    if(pool->free_list == NULL) {
+        unsigned char *slab = ecs_mem_alloc(pool->parent, pool->block_size * pool->blocks_per_slab);
+        ECS_ASSERT(slab != NULL && "Buy more RAM lol");
+        ecs_da_append_with(pool->parent, &pool->slabs, slab);
+        for(size_t i = pool->blocks_per_slab; i-- > 0;) {
+            void *block = slab + i * pool->block_size;
+            *(void**)block = pool->free_list;
+            pool->free_list = block;
+        }
+    }
+    void *block = pool->free_list;
+    pool->free_list = *(void**)block;
+    return block;
+}
+
+void ecs_pool_release(ECSPool *pool, void *ptr, size_t size) {
+    if(ptr == NULL) return;
+    if(size > pool->block_size) {
+        ecs_mem_free(pool->parent, ptr, size);
+        return;
+    }
+    *(void**)ptr = pool->free_list;
+    pool->free_list = ptr;
+}
+
+void ecs_pool_destroy(ECSPool *pool) {
+    ecs_da_foreach(void*, slab, &pool->slabs) {
+        ecs_mem_free(pool->parent, *slab, pool->block_size * pool->blocks_per_slab);
+    }
+    ecs_da_free_with(pool->parent, &pool->slabs);
+    ecs_pool_init(pool, pool->block_size, pool->blocks_per_slab, pool->parent);
+}
+
+static void* ecs_pool_vt_alloc(void *ctx, size_t size) {
+    return ecs_pool_alloc(ctx, size);
+}
+
+static void* ecs_pool_vt_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size) {
+    ECSPool *pool = ctx;
+    if(old_size <= pool->block_size && new_size <= pool->block_size) return ptr;
+    void *result = ecs_pool_alloc(pool, new_size);
+    if(result != NULL) memcpy(result, ptr, old_size < new_size ? old_size : new_size);
+    ecs_pool_release(pool, ptr, old_size);
+    return result;
+}
+
+static void ecs_pool_vt_free(void *ctx, void *ptr, size_t size) {
+    ecs_pool_release(ctx, ptr, size);
+}
+
+ECSAllocator ecs_pool_allocator(ECSPool *pool) {
+    return (ECSAllocator){
+        .alloc = ecs_pool_vt_alloc,
+        .realloc = ecs_pool_vt_realloc,
+        .free = ecs_pool_vt_free,
+        .ctx = pool,
+    };
+}
+
+#ifdef ECS_PROFILE
+// ----------------------
+// Profiling
+// ----------------------
+static _Atomic(ECSProfileRing*) ecs_profile_rings; // every thread that recorded something, newest first
+static atomic_size_t ecs_profile_threads;
+static _Thread_local ECSProfileRing *ecs_profile_ring;
+
+static uint64_t ecs_profile_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+#ifdef ECS_PROFILE_COUNTERS
+static const struct { uint32_t type; uint64_t config; const char *name; } ecs_counters[ECS_COUNTER_COUNT] = {
+    [ECS_COUNTER_CYCLES]        = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+    [ECS_COUNTER_INSTRUCTIONS]  = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+    [ECS_COUNTER_L1D_MISSES]    = { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16, "l1d_misses" },
+    [ECS_COUNTER_LLC_MISSES]    = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "llc_misses" },
+    [ECS_COUNTER_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch_misses" },
+};
+
+static void ecs_counters_close(ECSProfileRing *ring) {
+    for(size_t i = 0; i < ECS_COUNTER_COUNT; ++i) {
+        if(ring->fds[i] >= 0) close(ring->fds[i]);
+        ring->fds[i] = ring->slots[i] = -1;
+    }
+    ring->leader = -1;
+}
+
+// One group per thread, counting user space only, so a single read() returns all of them
+static void ecs_counters_open(ECSProfileRing *ring) {
+    ring->leader = -1;
+    for(size_t i = 0; i < ECS_COUNTER_COUNT; ++i) ring->fds[i] = ring->slots[i] = -1;
+    int opened = 0;
+    for(size_t i = 0; i < ECS_COUNTER_COUNT; ++i) {
+        struct perf_event_attr attr = {
+            .size = sizeof(attr),
+            .type = ecs_counters[i].type,
+            .config = ecs_counters[i].config,
+            .read_format = PERF_FORMAT_GROUP,
+            .exclude_kernel = 1,
+            .exclude_hv = 1,
+        };
+        int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, ring->leader, 0);
+        if(fd < 0) {
+            // not allowed or no perf events at all, the other counters won't open either
+            if(errno == EACCES || errno == EPERM || errno == ENOSYS) break;
+            continue; // ENOENT, EOPNOTSUPP...: this PMU lacks the event
+        }
+        ring->fds[i] = fd;
+        ring->slots[i] = opened++;
+        if(ring->leader < 0) ring->leader = fd;
+    }
+    uint64_t values[1 + ECS_COUNTER_COUNT];
+    if(ring->leader < 0 || read(ring->leader, values, sizeof(values)) <= 0) ecs_counters_close(ring);
+}
+
+#ifndef ECS_NO_THREADS
+static pthread_key_t ecs_counters_key;
+static pthread_once_t ecs_counters_once = PTHREAD_ONCE_INIT;
+
+static void ecs_counters_exit(void *ring) {
+    ecs_counters_close(ring);
+}
+
+static void ecs_counters_key_create() {
+    pthread_key_create(&ecs_counters_key, ecs_counters_exit);
+}
+#endif
+
+static void ecs_counters_read(ECSProfileRing *ring, uint64_t *out) {
+    uint64_t values[1 + ECS_COUNTER_COUNT] = {0}; // counter count, then the values in opening order
+    if(ring->leader >= 0 && read(ring->leader, values, sizeof(values)) <= 0) memset(values, 0, sizeof(values));
+    for(size_t i = 0; i < ECS_COUNTER_COUNT; ++i) {
+        out[i] = ring->slots[i] >= 0 ? values[1 + ring->slots[i]] : 0;
+    }
+}
+#endif
+
+static ECSProfileRing* ecs_profile_thread() {
+    ECSProfileRing *ring = ecs_profile_ring;
+    if(ring != NULL) return ring;
+    // never freed, the threads of a pool keep their ring from one frame to the next
+    ring = ECS_REALLOC(NULL, sizeof(ECSProfileRing));
+    ECS_ASSERT(ring != NULL && "Buy more RAM lol");
+    atomic_init(&ring->head, 0);
+    ring->thread = atomic_fetch_add(&ecs_profile_threads, 1);
+#ifdef ECS_PROFILE_COUNTERS
+    ecs_counters_open(ring);
+#ifndef ECS_NO_THREADS
+    // closes the counters when the thread exits, the ring itself stays for the export
+    pthread_once(&ecs_counters_once, ecs_counters_key_create);
+    pthread_setspecific(ecs_counters_key, ring);
+#endif
+#endif
+    ring->next = atomic_load(&ecs_profile_rings);
+    while(!atomic_compare_exchange_weak(&ecs_profile_rings, &ring->next, ring));
+    ecs_profile_ring = ring;
+    return ring;
+}
+
+ECSProfileZone ecs_profile_begin(ECSWorld *w, const char *name) {
+    ECSProfileRing *ring = ecs_profile_thread();
+    ECSProfileZone zone = {
+        .name = name,
+        .outer = ecs_profile_zone,
+        .counters = ecs_profile_counters,
+        .frame = w != NULL ? w->tick : 0,
+    };
+#ifdef ECS_PROFILE_COUNTERS
+    ecs_counters_read(ring, zone.hardware);
+#else
+    (void)ring;
+#endif
+    ecs_profile_zone = name;
+    zone.start = ecs_profile_now();
+    return zone;
+}
+
+void ecs_profile_end(ECSProfileZone *zone) {
+    uint64_t end = ecs_profile_now();
+    ECS_ASSERT(ecs_profile_zone == zone->name && "Profile zones have to end innermost first");
+    ECSProfileRing *ring = ecs_profile_thread();
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ECSProfileEvent *event = &ring->events[head % ECS_PROFILE_RING];
+    *event = (ECSProfileEvent){
+        .name = zone->name,
+        .start = zone->start,
+        .duration = end - zone->start,
+        .visited = ecs_profile_counters.visited - zone->counters.visited,
+        .matched = ecs_profile_counters.matched - zone->counters.matched,
+        .frame = zone->frame,
+        .task = zone->task,
+    };
+#ifdef ECS_PROFILE_COUNTERS
+    ecs_counters_read(ring, event->hardware);
+    for(size_t i = 0; i < ECS_COUNTER_COUNT; ++i) {
+        event->hardware[i] = event->hardware[i] > zone->hardware[i] ? event->hardware[i] - zone->hardware[i] : 0;
+    }
+#endif
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    ecs_profile_zone = zone->outer;
+}
+
+static void ecs_profile_write_name(FILE *f, const char *name) {
+    fputc('"', f);
+    for(; *name; ++name) {
+        if((unsigned char)*name < 0x20) continue;
+        if(*name == '"' || *name == '\\') fputc('\\', f);
+        fputc(*name, f);
+    }
+    fputc('"', f);
+}
+
+// Complete ("X") events with microsecond timestamps, one trace thread per ring
+bool ecs_profile_export(const char *path) {
+    FILE *f = fopen(path, "wb");
+    if(f == NULL) return false;
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    const char *separator = "\n";
+    for(ECSProfileRing *ring = atomic_load(&ecs_profile_rings); ring != NULL; ring = ring->next) {
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"thread %zu\"}}",
+                separator, ring->thread, ring->thread);
+        separator = ",\n";
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for(size_t i = head > ECS_PROFILE_RING ? head - ECS_PROFILE_RING : 0; i < head; ++i) {
+            ECSProfileEvent *event = &ring->events[i % ECS_PROFILE_RING];
+            fprintf(f, "%s{\"name\":", separator);
+            ecs_profile_write_name(f, event->name);
+            fprintf(f, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f,"
+                       "\"args\":{\"frame\":%u,\"visited\":%zu,\"matched\":%zu",
+                    event->task ? "task" : "ecs", ring->thread, event->start / 1000.0, event->duration / 1000.0,
+                    event->frame, event->visited, event->matched);
+#ifdef ECS_PROFILE_COUNTERS
+            for(size_t c = 0; c < ECS_COUNTER_COUNT; ++c) {
+                fprintf(f, ",\"%s\":%llu", ecs_counters[c].name, (unsigned long long)event->hardware[c]);
+            }
+#endif
+            fprintf(f, "}}");
+        }
+    }
+    fprintf(f, "\n]}\n");
+    bool ok = !ferror(f);
+    if(fclose(f) != 0) ok = false;
+    return ok;
+}
+
+typedef struct {
+    const char *name;
+    bool task;
+    size_t calls, visited, matched;
+    uint64_t duration;
+#ifdef ECS_PROFILE_COUNTERS
+    uint64_t hardware[ECS_COUNTER_COUNT];
+#endif
+} ECSProfileTotal;
+
+typedef struct {
+    ECSProfileTotal *items;
+    size_t capacity, count;
+} ECSProfileTotals;
+
+static double ecs_profile_ratio(uint64_t n, uint64_t d) {
+    return d > 0 ? (double)n / (double)d : 0.0;
+}
+
+// One line per system or zone name, summed over every event still in the rings. The parallel
+// tasks a zone started get a line of their own.
+void ecs_profile_report(FILE *out) {
+    ECSProfileTotals totals = {0};
+    for(ECSProfileRing *ring = atomic_load(&ecs_profile_rings); ring != NULL; ring = ring->next) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for(size_t i = head > ECS_PROFILE_RING ? head - ECS_PROFILE_RING : 0; i < head; ++i) {
+            ECSProfileEvent *event = &ring->events[i % ECS_PROFILE_RING];
+            ECSProfileTotal *total = NULL;
+            ecs_da_foreach(ECSProfileTotal, it, &totals) {
+                if(it->task == event->task && (it->name == event->name || strcmp(it->name, event->name) == 0)) total = it;
+            }
+            if(total == NULL) {
+                ecs_da_append(&totals, ((ECSProfileTotal){ .name = event->name, .task = event->task }));
+                total = &ecs_da_last(&totals);
+            }
+            total->calls++;
+            total->duration += event->duration;
+            total->visited += event->visited;
+            total->matched += event->matched;
+#ifdef ECS_PROFILE_COUNTERS
+            for(size_t c = 0; c < ECS_COUNTER_COUNT; ++c) total->hardware[c] += event->hardware[c];
+#endif
+        }
+    }
+    fprintf(out, "%-24s %8s %12s %12s %12s", "name", "calls", "us/call", "visited", "matched");
+#ifdef ECS_PROFILE_COUNTERS
+    fprintf(out, " %6s %12s %12s %12s", "ipc", "l1d/entity", "llc/entity", "branch/ent");
+#endif
+    fprintf(out, "\n");
+    ecs_da_foreach(ECSProfileTotal, it, &totals) {
+        char name[64];
+        snprintf(name, sizeof(name), "%s%s", it->name, it->task ? " (tasks)" : "");
+        fprintf(out, "%-24s %8zu %12.3f %12zu %12zu", name, it->calls,
+                ecs_profile_ratio(it->duration, it->calls) / 1000.0, it->visited, it->matched);
+#ifdef ECS_PROFILE_COUNTERS
+        fprintf(out, " %6.2f %12.3f %12.3f %12.3f",
+                ecs_profile_ratio(it->hardware[ECS_COUNTER_INSTRUCTIONS], it->hardware[ECS_COUNTER_CYCLES]),
+                ecs_profile_ratio(it->hardware[ECS_COUNTER_L1D_MISSES], it->matched),
+                ecs_profile_ratio(it->hardware[ECS_COUNTER_LLC_MISSES], it->matched),
+                ecs_profile_ratio(it->hardware[ECS_COUNTER_BRANCH_MISSES], it->matched));
+#endif
+        fprintf(out, "\n");
+    }
+    ECS_FREE(totals.items);
+}
+
+void ecs_profile_reset() {
+    for(ECSProfileRing *ring = atomic_load(&ecs_profile_rings); ring != NULL; ring = ring->next) {
+        atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+    }
+}
+
+// Closes the counters of every thread, the events stay. Call it once no thread records anymore,
+// zones recorded afterwards get zero counters.
+void ecs_profile_shutdown() {
+#ifdef ECS_PROFILE_COUNTERS
+    for(ECSProfileRing *ring = atomic_load(&ecs_profile_rings); ring != NULL; ring = ring->next) {
+        ecs_counters_close(ring);
+    }
+#endif
+}
+#endif // ECS_PROFILE
 
 #endif // ECS_IMPLEMENTATION
 
@@ -0,0 +1,237 @@
+// Headless micro-benchmarks, built by `./nob bench` as build/bench and build/bench_archetypes.
+//
+//     ./build/bench [max_entities]
+//
+// Every case prints one line `mode case entities reps ns_per_entity allocs bytes`, lines starting
+// with '#' are comments. `allocs` and `bytes` count the calls into the world's allocator (alloc and
+// realloc, frees are not counted) during the timed part, averaged over the reps.
+#define ECS_IMPLEMENTATION
+#include "../ecs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// smaller sizes are repeated so every case does about this many entities worth of work
+#define BENCH_WORK 1000000
+
+#ifdef ECS_ARCHETYPES
+#define BENCH_MODE "archetypes"
+#else
+#define BENCH_MODE "sparse"
+#endif
+
+Component(Position, struct { float x, y; });
+Component(Velocity, struct { float dx, dy; });
+Component(Transform, struct { float m[16]; });
+
+typedef struct {
+    size_t allocs, bytes;
+} BenchCounter;
+
+static void* bench_alloc(void *ctx, size_t size) {
+    BenchCounter *counter = ctx;
+    counter->allocs += 1;
+    counter->bytes += size;
+    return malloc(size);
+}
+
+static void* bench_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size) {
+    BenchCounter *counter = ctx;
+    (void)old_size;
+    counter->allocs += 1;
+    counter->bytes += new_size;
+    return realloc(ptr, new_size);
+}
+
+static void bench_free(void *ctx, void *ptr, size_t size) {
+    (void)ctx; (void)size;
+    free(ptr);
+}
+
+static BenchCounter counter;
+static const ECSAllocator counting_allocator = {
+    .alloc = bench_alloc,
+    .realloc = bench_realloc,
+    .free = bench_free,
+    .ctx = &counter,
+};
+
+typedef struct {
+    uint64_t ns;
+    size_t allocs, bytes;
+    uint64_t started;
+    BenchCounter at_start;
+} BenchResult;
+
+// keeps the compiler from throwing the reads away
+static volatile float bench_sink;
+
+static uint64_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void bench_begin(BenchResult *r) {
+    r->at_start = counter;
+    r->started = bench_now();
+}
+
+static void bench_end(BenchResult *r) {
+    r->ns += bench_now() - r->started;
+    r->allocs += counter.allocs - r->at_start.allocs;
+    r->bytes += counter.bytes - r->at_start.bytes;
+}
+
+static void bench_report(const char *name, size_t entities, size_t reps, BenchResult r) {
+    printf("%s %s %zu %zu %.2f %.2f %.2f\n", BENCH_MODE, name, entities, reps,
+           (double)r.ns / (double)(entities * reps), (double)r.allocs / (double)reps, (double)r.bytes / (double)reps);
+    fflush(stdout);
+}
+
+static void world_init(ECSWorld *w) {
+    *w = (ECSWorld){0};
+    ecs_set_allocator(w, &counting_allocator);
+#ifdef ECS_ARCHETYPES
+    ecs_set_chunk_allocator(w, &counting_allocator);
+#endif
+}
+
+static void bench_spawn(size_t n, size_t reps, ECSEntityId *ids) {
+    BenchResult spawn = {0}, spawn_bulk = {0}, despawn = {0}, despawn_bulk = {0};
+    for(size_t rep = 0; rep < reps; ++rep) {
+        ECSWorld w;
+        world_init(&w);
+        bench_begin(&spawn);
+        for(size_t i = 0; i < n; ++i) ids[i] = ecs_spawn_entity(&w)->id;
+        bench_end(&spawn);
+        bench_begin(&despawn);
+        for(size_t i = 0; i < n; ++i) ecs_despawn_entity_with_id(&w, ids[i]);
+        bench_end(&despawn);
+        ecs_deinit(&w);
+
+        world_init(&w);
+        bench_begin(&spawn_bulk);
+        ecs_spawn_entities(&w, n, ids);
+        bench_end(&spawn_bulk);
+        bench_begin(&despawn_bulk);
+        ecs_despawn_entities(&w, ids, n);
+        bench_end(&despawn_bulk);
+        ecs_deinit(&w);
+    }
+    bench_report("spawn", n, reps, spawn);
+    bench_report("despawn", n, reps, despawn);
+    bench_report("spawn_bulk", n, reps, spawn_bulk);
+    bench_report("despawn_bulk", n, reps, despawn_bulk);
+}
+
+static void bench_component(size_t component, size_t n, size_t reps, ECSEntityId *ids) {
+    unsigned char value[64] = {0};
+    ECS_ASSERT(ecs_components.items[component].size <= sizeof(value));
+    BenchResult add = {0}, get = {0}, remove = {0};
+    const char *name = ecs_components.items[component].name;
+    char label[64];
+    for(size_t rep = 0; rep < reps; ++rep) {
+        ECSWorld w;
+        world_init(&w);
+        ecs_spawn_entities(&w, n, ids);
+        bench_begin(&add);
+        for(size_t i = 0; i < n; ++i) ecs_component_add(&w, ecs_get_entity_with_id(&w, ids[i]), component, value);
+        bench_end(&add);
+        float sum = 0.0f;
+        bench_begin(&get);
+        for(size_t i = 0; i < n; ++i) sum += *(float*)ecs_component_get(&w, ecs_get_entity_with_id(&w, ids[i]), component);
+        bench_end(&get);
+        bench_sink = sum;
+        bench_begin(&remove);
+        for(size_t i = 0; i < n; ++i) ecs_component_remove(&w, ecs_get_entity_with_id(&w, ids[i]), component);
+        bench_end(&remove);
+        ecs_deinit(&w);
+    }
+    snprintf(label, sizeof(label), "add/%s", name);
+    bench_report(label, n, reps, add);
+    snprintf(label, sizeof(label), "get/%s", name);
+    bench_report(label, n, reps, get);
+    snprintf(label, sizeof(label), "remove/%s", name);
+    bench_report(label, n, reps, remove);
+}
+
+// every entity has a Position, one in `every` also has a Velocity; ns/entity is over the whole world
+static void bench_query(const char *name, size_t every, size_t n, size_t reps, ECSEntityId *ids) {
+    ECSWorld w;
+    world_init(&w);
+    ecs_spawn_entities(&w, n, ids);
+    for(size_t i = 0; i < n; ++i) {
+        ECSEntity *e = ecs_get_entity_with_id(&w, ids[i]);
+        add_Position(&w, e, (Position){(float)i, 0.0f});
+        if(i % every == 0) add_Velocity(&w, e, (Velocity){1.0f, 1.0f});
+    }
+    BenchResult query = {0};
+    for(size_t rep = 0; rep < reps; ++rep) {
+        bench_begin(&query);
+        QueryByComponents(&w, e, COMP_Position, COMP_Velocity) {
+            Position *p = get_Position(&w, e);
+            Velocity *v = get_Velocity(&w, e);
+            p->x += v->dx;
+            p->y += v->dy;
+        }
+        bench_end(&query);
+    }
+    bench_sink = get_Position(&w, ecs_get_entity_with_id(&w, ids[0]))->x;
+    ecs_deinit(&w);
+    bench_report(name, n, reps, query);
+}
+
+// despawns random entities and spawns a new one with a Position right away, so every spawn reuses a slot
+static void bench_churn(size_t n, size_t reps, ECSEntityId *ids) {
+    ECSWorld w;
+    world_init(&w);
+    ecs_spawn_entities(&w, n, ids);
+    for(size_t i = 0; i < n; ++i) add_Position(&w, ecs_get_entity_with_id(&w, ids[i]), (Position){0});
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    BenchResult churn = {0};
+    for(size_t rep = 0; rep < reps; ++rep) {
+        bench_begin(&churn);
+        for(size_t i = 0; i < n; ++i) {
+            state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+            size_t slot = state % n;
+            ecs_despawn_entity_with_id(&w, ids[slot]);
+            ECSEntity *e = ecs_spawn_entity(&w);
+            add_Position(&w, e, (Position){(float)i, 0.0f});
+            ids[slot] = e->id;
+        }
+        bench_end(&churn);
+    }
+    ecs_deinit(&w);
+    bench_report("churn", n, reps, churn);
+}
+
+int main(int argc, char **argv) {
+    size_t max_entities = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    if(max_entities == 0) max_entities = 1;
+    register_Position();
+    register_Velocity();
+    register_Transform();
+
+    ECSEntityId *ids = malloc(max_entities * sizeof(*ids));
+    ECS_ASSERT(ids != NULL && "Buy more RAM lol");
+
+    printf("# mode case entities reps ns_per_entity allocs bytes\n");
+    // below 10k only max_entities itself is run
+    for(size_t n = max_entities < 10000 ? max_entities : 10000; n <= max_entities; n *= 10) {
+        size_t reps = n < BENCH_WORK ? BENCH_WORK / n : 1;
+        bench_spawn(n, reps, ids);
+        bench_component(COMP_Position, n, reps, ids);
+        bench_component(COMP_Velocity, n, reps, ids);
+        bench_component(COMP_Transform, n, reps, ids);
+        bench_query("query/1%", 100, n, reps, ids);
+        bench_query("query/10%", 10, n, reps, ids);
+        bench_query("query/100%", 1, n, reps, ids);
+        bench_churn(n, reps, ids);
+    }
+
+    free(ids);
+    return 0;
+}
@@ -0,0 +1,105 @@
+// Headless replication check, built by `./nob replication` as build/replication and
+// build/replication_archetypes. Exits with 1 and prints the failed check when the receiver
+// goes out of sync with the sender.
+//
+// The sender keeps its parent links to itself, the receiver links the same entities on its own.
+// Parents get despawned with their children and their slots are recycled within one delta, which
+// must leave the receiver with the sender's ids and free list.
+#define ECS_IMPLEMENTATION
+#include "../ecs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define check(cond) do { \
+        if(!(cond)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); exit(1); } \
+    } while(0)
+
+Component(Health, struct { int hp; });
+
+static size_t removed;
+
+static void on_remove(ECSWorld *w, size_t component, const ECSEntityId *ids, size_t count, void *ctx) {
+    (void)w; (void)component; (void)ids; (void)ctx;
+    removed += count;
+}
+
+static void check_same(ECSWorld *a, ECSWorld *b) {
+    check(a->entities.count == b->entities.count);
+    check(a->dead_entities.count == b->dead_entities.count);
+    for(size_t i = 0; i < a->dead_entities.count; ++i) check(a->dead_entities.items[i] == b->dead_entities.items[i]);
+    for(size_t i = 0; i < a->entities.count; ++i) {
+        ECSEntity *x = &a->entities.items[i], *y = &b->entities.items[i];
+        check(x->id == y->id);
+        if(x->id & ECS_ENTITY_DEAD) continue;
+        check(ecs_mask_equals(&x->mask, &y->mask));
+        Health *hx = get_Health(a, x), *hy = get_Health(b, y);
+        check((hx == NULL) == (hy == NULL));
+        if(hx != NULL) check(hx->hp == hy->hp);
+    }
+}
+
+static void replicate(ECSWorld *w, ECSWorld *mirror, ECSWorld *remote) {
+    ECSDelta delta = {0};
+    ecs_delta_encode(w, mirror, &delta);
+    check(ecs_delta_apply(remote, delta.items, delta.count));
+    ecs_delta_free(&delta);
+    check_same(w, mirror);
+    check_same(w, remote);
+}
+
+static ECSEntity* entity(ECSWorld *w, ECSEntityId id) {
+    ECSEntity *e = ecs_get_entity_with_id(w, id);
+    check(e != NULL);
+    return e;
+}
+
+int main(void) {
+    register_Health();
+    ECSWorld w = {0}, mirror = {0}, remote = {0};
+    ecs_observe(&remote, COMP_Health, ECS_ON_REMOVE, on_remove, NULL);
+
+    // a parent with a child, and a bystander
+    ECSEntityId parent = ecs_spawn_entity(&w)->id;
+    ECSEntityId child = ecs_spawn_entity(&w)->id;
+    ECSEntityId other = ecs_spawn_entity(&w)->id;
+    add_Health(&w, entity(&w, parent), (Health){1});
+    add_Health(&w, entity(&w, child), (Health){2});
+    add_Health(&w, entity(&w, other), (Health){3});
+    ecs_set_parent(&w, entity(&w, child), entity(&w, parent));
+    replicate(&w, &mirror, &remote);
+    ecs_set_parent(&remote, entity(&remote, child), entity(&remote, parent));
+
+    // the child dies with its parent and both slots come back in the same delta
+    ecs_despawn_entity_with_id(&w, parent);
+    check(w.dead_entities.count == 2);
+    parent = ecs_spawn_entity(&w)->id;
+    child = ecs_spawn_entity(&w)->id;
+    add_Health(&w, entity(&w, parent), (Health){4});
+    ecs_set_parent(&w, entity(&w, child), entity(&w, parent));
+    replicate(&w, &mirror, &remote);
+    check(removed == 2);
+    check(ecs_is_alive(&remote, other));
+    check(ecs_first_child(&remote, entity(&remote, parent)) == NULL);
+    ecs_set_parent(&remote, entity(&remote, child), entity(&remote, parent));
+
+    // only the parent is recycled, the child stays alive on both sides
+    ecs_set_parent(&w, entity(&w, child), NULL);
+    ecs_despawn_entity_with_id(&w, parent);
+    ECSEntityId recycled = ecs_spawn_entity(&w)->id;
+    replicate(&w, &mirror, &remote);
+    check(ecs_is_alive(&remote, child) && !ecs_is_alive(&remote, parent));
+    check(ecs_first_child(&remote, entity(&remote, recycled)) == NULL);
+
+    // the free lists still agree, so both sides hand out the same id next
+    ecs_despawn_entity_with_id(&w, other);
+    replicate(&w, &mirror, &remote);
+    check(ecs_spawn_entity(&remote)->id == ecs_spawn_entity(&w)->id);
+
+    ecs_deinit(&w);
+    ecs_deinit(&mirror);
+    ecs_deinit(&remote);
+    printf("replication ok\n");
+    return 0;
+}
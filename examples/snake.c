@@ -11,35 +11,34 @@
 
 #define BOARD_WIDTH 40
 #define BOARD_HEIGHT 10
-#define MAX_SNAKE_LENGTH (BOARD_WIDTH * BOARD_HEIGHT)
 
 
 Component(Position, struct { int x, y; });
 Component(Velocity, struct { int dx, dy; });
-Component(SnakeHead, struct { int length; });
+// body segments hang off the head one below the other, `tail` is the last of them
+Component(SnakeHead, struct { int length; ECSEntityId tail; });
 Component(SnakeBody, struct { int segment_index; });
 Component(Food, struct { int value; });
 Component(Renderable, struct { char symbol; });
+ecs_spatial_position(Position, x, y)
 
 
-typedef struct {
-    bool running;
-    int score;
-    struct termios old_termios;
-} GameState;
+Resource(GameState, struct { bool running; int score; });
 
-static GameState game_state = {0};
+static struct termios old_termios;
+// every entity with a Position, looked up by board cell
+static ECSSpatialIndex board_index;
 
 void setup_terminal() {
     struct termios new_termios;
-    tcgetattr(STDIN_FILENO, &game_state.old_termios);
-    new_termios = game_state.old_termios;
+    tcgetattr(STDIN_FILENO, &old_termios);
+    new_termios = old_termios;
     new_termios.c_lflag &= ~(ICANON | ECHO);
     tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
 }
 
 void restore_terminal() {
-    tcsetattr(STDIN_FILENO, TCSANOW, &game_state.old_termios);
+    tcsetattr(STDIN_FILENO, TCSANOW, &old_termios);
 }
 
 bool kbhit() {
@@ -55,8 +54,8 @@ System(input) {
 
     char input = getchar();
 
-    QueryByComponents(snake, COMP_SnakeHead | COMP_Velocity) {
-        Velocity* vel = get_Velocity(snake);
+    QueryByComponents(world, snake, COMP_SnakeHead, COMP_Velocity) {
+        Velocity* vel = get_Velocity(world, snake);
 
         switch(input) {
             case 'w':
@@ -77,30 +76,27 @@ System(input) {
                 break;
             case 'q':
             case 'Q':
-                game_state.running = false;
+                get_GameState(world)->running = false;
                 break;
         }
     }
 }
 
+// Each segment takes the spot its parent just left, the hierarchy hands them out head first
+static void follow_parent(ECSWorld *world, ECSEntity *segment, ECSEntity *parent, void *ctx) {
+    Position *vacated = ctx;
+    if (parent == NULL) return;
+    Position *pos = get_mut_Position(world, segment);
+    Position left = *pos;
+    *pos = *vacated;
+    *vacated = left;
+}
+
 System(movement) {
-    static Position snake_positions[MAX_SNAKE_LENGTH];
-    static int position_count = 0;
-
-    QueryByComponents(head, COMP_SnakeHead | COMP_Position | COMP_Velocity) {
-        Position* head_pos = get_Position(head);
-        Velocity* vel = get_Velocity(head);
-        SnakeHead* snake_head = get_SnakeHead(head);
-
-        if (position_count < MAX_SNAKE_LENGTH) {
-            snake_positions[position_count] = *head_pos;
-            position_count++;
-        } else {
-            for (int i = 0; i < MAX_SNAKE_LENGTH - 1; i++) {
-                snake_positions[i] = snake_positions[i + 1];
-            }
-            snake_positions[MAX_SNAKE_LENGTH - 1] = *head_pos;
-        }
+    QueryByComponents(world, head, COMP_SnakeHead, COMP_Position, COMP_Velocity) {
+        Position* head_pos = get_mut_Position(world, head);
+        Velocity* vel = get_Velocity(world, head);
+        Position vacated = *head_pos;
 
         head_pos->x += vel->dx;
         head_pos->y += vel->dy;
@@ -110,49 +106,57 @@ System(movement) {
         if (head_pos->y < 0) head_pos->y = BOARD_HEIGHT - 1;
         if (head_pos->y >= BOARD_HEIGHT) head_pos->y = 0;
 
-        QueryByComponents(body, COMP_SnakeBody | COMP_Position) {
-            SnakeBody* snake_body = get_SnakeBody(body);
-            if (snake_body->segment_index < snake_head->length &&
-                snake_body->segment_index < position_count - 1) {
-                Position* body_pos = get_Position(body);
-                int pos_idx = position_count - 2 - snake_body->segment_index;
-                if (pos_idx >= 0) {
-                    *body_pos = snake_positions[pos_idx];
-                }
-            }
-        }
+        ecs_hierarchy_mark(world, head);
+        ecs_hierarchy_propagate(world, ECS_NO_COMPONENT, 0, follow_parent, &vacated);
     }
 }
 
 System(collision) {
-    QueryByComponents(head, COMP_SnakeHead | COMP_Position) {
-        Position* head_pos = get_Position(head);
-        SnakeHead* snake_head = get_SnakeHead(head);
-
-        QueryByComponents(body, COMP_SnakeBody | COMP_Position) {
-            Position* body_pos = get_Position(body);
-            if (head_pos->x == body_pos->x && head_pos->y == body_pos->y) {
-                game_state.running = false;
-                return;
-            }
-        }
+    // new segments are spawned once the queries below are done
+    static ECSCommandBuffer commands = {0};
 
-        QueryByComponents(food, COMP_Food | COMP_Position) {
-            Position* food_pos = get_Position(food);
-            if (head_pos->x == food_pos->x && head_pos->y == food_pos->y) {
-                snake_head->length++;
-                game_state.score += 10;
+    // picks up what movement wrote through get_mut_
+    ecs_spatial_sync(&board_index);
+
+    // entity id 0 is valid, so growing is tracked on its own
+    bool grew = false, bit_itself = false;
+    ECSEntityId grown_head = 0;
 
-                ECSEntity* new_segment = ecs_spawn_entity();
-                add_Position(new_segment, (Position){head_pos->x, head_pos->y});
-                add_SnakeBody(new_segment, (SnakeBody){snake_head->length - 1});
-                add_Renderable(new_segment, (Renderable){'o'});
+    QueryByComponents(world, head, COMP_SnakeHead, COMP_Position) {
+        Position* head_pos = get_Position(world, head);
+        SnakeHead* snake_head = get_SnakeHead(world, head);
 
-                food_pos->x = rand() % BOARD_WIDTH;
-                food_pos->y = rand() % BOARD_HEIGHT;
+        QueryPoint(&board_index, other, head_pos->x, head_pos->y) {
+            if (ecs_mask_test(&other->mask, COMP_SnakeBody)) {
+                get_GameState(world)->running = false;
+                bit_itself = true;
+                break;
+            }
+            if (ecs_mask_test(&other->mask, COMP_Food)) {
+                snake_head->length++;
+                get_GameState(world)->score += 10;
+
+                // the new segment starts under the tail and gets linked to it after the flush
+                ECSEntityId new_segment = ecs_cmd_spawn(&commands);
+                cmd_add_Position(&commands, new_segment, *get_Position(world, ecs_get_entity_with_id(world, snake_head->tail)));
+                cmd_add_SnakeBody(&commands, new_segment, (SnakeBody){snake_head->length - 1});
+                cmd_add_Renderable(&commands, new_segment, (Renderable){'o'});
+                grew = true;
+                grown_head = head->id;
+
+                // moving the food reorders the index, so it goes through the buffer as well
+                cmd_add_Position(&commands, other->id, (Position){rand() % BOARD_WIDTH, rand() % BOARD_HEIGHT});
             }
         }
-
+        if (bit_itself) break;
+    }
+    // whatever got queued this tick is applied now, even when the game just ended
+    ECSEntityId spawned[1];
+    ecs_cmd_flush(&commands, world, spawned);
+    if (grew) {
+        SnakeHead* snake_head = get_SnakeHead(world, ecs_get_entity_with_id(world, grown_head));
+        ecs_set_parent(world, ecs_get_entity_with_id(world, spawned[0]), ecs_get_entity_with_id(world, snake_head->tail));
+        snake_head->tail = spawned[0];
     }
 }
 
@@ -162,9 +166,9 @@ System(render) {
     char board[BOARD_HEIGHT][BOARD_WIDTH];
     memset(board, ' ', sizeof(board));
 
-    QueryByComponents(entity, COMP_Position | COMP_Renderable) {
-        Position* pos = get_Position(entity);
-        Renderable* render = get_Renderable(entity);
+    QueryByComponents(world, entity, COMP_Position, COMP_Renderable) {
+        Position* pos = get_Position(world, entity);
+        Renderable* render = get_Renderable(world, entity);
         if (pos->x >= 0 && pos->x < BOARD_WIDTH && pos->y >= 0 && pos->y < BOARD_HEIGHT) {
             board[pos->y][pos->x] = render->symbol;
         }
@@ -186,32 +190,35 @@ System(render) {
     for (int x = 0; x < BOARD_WIDTH; x++) printf("─");
     printf("┘\n");
 
-    printf("Score: %d\n", game_state.score);
+    printf("Score: %d\n", get_GameState(world)->score);
     printf("Controls: WASD to move, Q to quit\n");
 
     fflush(stdout);
 }
 
-void spawn_snake() {
-    ECSEntity* head = ecs_spawn_entity();
-    add_Position(head, (Position){BOARD_WIDTH/2, BOARD_HEIGHT/2});
-    add_Velocity(head, (Velocity){1, 0});
-    add_SnakeHead(head, (SnakeHead){3});
-    add_Renderable(head, (Renderable){'@'});
+void spawn_snake(ECSWorld *world) {
+    ECSEntity* head = ecs_spawn_entity(world);
+    add_Position(world, head, (Position){BOARD_WIDTH/2, BOARD_HEIGHT/2});
+    add_Velocity(world, head, (Velocity){1, 0});
+    add_Renderable(world, head, (Renderable){'@'});
 
+    ECSEntityId head_id = head->id, tail = head_id;
     for (int i = 0; i < 3; i++) {
-        ECSEntity* body = ecs_spawn_entity();
-        add_Position(body, (Position){BOARD_WIDTH/2 - 1 - i, BOARD_HEIGHT/2});
-        add_SnakeBody(body, (SnakeBody){i});
-        add_Renderable(body, (Renderable){'o'});
+        ECSEntity* body = ecs_spawn_entity(world);
+        add_Position(world, body, (Position){BOARD_WIDTH/2 - 1 - i, BOARD_HEIGHT/2});
+        add_SnakeBody(world, body, (SnakeBody){i});
+        add_Renderable(world, body, (Renderable){'o'});
+        ecs_set_parent(world, body, ecs_get_entity_with_id(world, tail));
+        tail = body->id;
     }
+    add_SnakeHead(world, ecs_get_entity_with_id(world, head_id), (SnakeHead){3, tail});
 }
 
-void spawn_food() {
-    ECSEntity* food = ecs_spawn_entity();
-    add_Position(food, (Position){rand() % BOARD_WIDTH, rand() % BOARD_HEIGHT});
-    add_Food(food, (Food){1});
-    add_Renderable(food, (Renderable){'*'});
+void spawn_food(ECSWorld *world) {
+    ECSEntity* food = ecs_spawn_entity(world);
+    add_Position(world, food, (Position){rand() % BOARD_WIDTH, rand() % BOARD_HEIGHT});
+    add_Food(world, food, (Food){1});
+    add_Renderable(world, food, (Renderable){'*'});
 }
 
 int main() {
@@ -223,26 +230,37 @@ int main() {
     register_SnakeBody();
     register_Food();
     register_Renderable();
+    register_GameState();
 
     setup_terminal();
-    game_state.running = true;
 
-    spawn_snake();
-    spawn_food();
+    ECSWorld world = {0};
+    set_GameState(&world, (GameState){ .running = true });
+    spawn_snake(&world);
+    spawn_food(&world);
+    ecs_spatial_init(&board_index, &world, COMP_Position, 1.0f, Position_spatial_position);
+
+    ECSScheduler scheduler = {0};
+    // reads stdin
+    ecs_schedule(&scheduler, input, (ECSEntityMask){0}, ecs_mask_all());
+    ecs_schedule(&scheduler, movement, ecs_mask(COMP_SnakeHead, COMP_SnakeBody, COMP_Velocity), ecs_mask(COMP_Position));
+    // spawns new segments
+    ecs_schedule(&scheduler, collision, (ECSEntityMask){0}, ecs_mask_all());
+    // writes stdout
+    ecs_schedule(&scheduler, render, (ECSEntityMask){0}, ecs_mask_all());
 
     struct timespec last_time, current_time;
     clock_gettime(CLOCK_MONOTONIC, &last_time);
 
-    while (game_state.running) {
+    while (get_GameState(&world)->running) {
         clock_gettime(CLOCK_MONOTONIC, &current_time);
         double elapsed = (current_time.tv_sec - last_time.tv_sec) +
                         (current_time.tv_nsec - last_time.tv_nsec) / 1e9;
 
         if (elapsed >= 0.15) {
-            input_system();
-            movement_system();
-            collision_system();
-            render_system();
+            ecs_scheduler_run(&scheduler, &world);
+            // the next frame's spatial sync only looks at what this one wrote
+            ecs_world_advance_tick(&world);
             last_time = current_time;
         }
 
@@ -250,8 +268,10 @@ int main() {
     }
 
     restore_terminal();
-    printf("\nGame Over! Final Score: %d\n", game_state.score);
-    ecs_deinit();
+    printf("\nGame Over! Final Score: %d\n", get_GameState(&world)->score);
+    ecs_scheduler_free(&scheduler);
+    ecs_spatial_free(&board_index);
+    ecs_deinit(&world);
 
     return 0;
 }
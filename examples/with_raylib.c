@@ -7,7 +7,7 @@
 
 #include "raylib.h"
 
-Component(Player, struct {})
+Tag(Player)
 Component(Rect, Rectangle)
 Component(Color, Color)
 Component(Velocity, struct {
@@ -15,25 +15,25 @@ Component(Velocity, struct {
 })
 
 System(draw_rects) {
-    QueryByComponents(e, COMP_Color | COMP_Rect) {
-        Color *c = get_Color(e);
-        Rectangle *r = get_Rect(e);
+    QueryByComponents(world, e, COMP_Color, COMP_Rect) {
+        Color *c = get_Color(world, e);
+        Rectangle *r = get_Rect(world, e);
         DrawRectangleRec(*r, *c);
     }
 }
 
 System(move_rects) {
-    QueryByComponents(e, COMP_Velocity | COMP_Rect) {
-        Velocity *v = get_Velocity(e);
-        Rectangle *r = get_Rect(e);
+    QueryByComponents(world, e, COMP_Velocity, COMP_Rect) {
+        Velocity *v = get_Velocity(world, e);
+        Rectangle *r = get_Rect(world, e);
         r->x += v->vx;
         r->y += v->vy;
     }
 }
 
 System(keyborad_events) {
-    QueryByComponents(e, COMP_Player | COMP_Velocity) {
-        Velocity *v = get_Velocity(e);
+    QueryByComponents(world, e, COMP_Player, COMP_Velocity) {
+        Velocity *v = get_Velocity(world, e);
         if(IsKeyPressed(KEY_W)) {v->vy = -1.0f; return;}
         if(IsKeyPressed(KEY_S)) {v->vy =  1.0f; return;}
         if(IsKeyPressed(KEY_D)) {v->vx =  1.0f; return;}
@@ -50,20 +50,21 @@ int main(void) {
     InitWindow(800, 600, "test");
     SetTargetFPS(60);
 
-    ECSEntity *square = ecs_spawn_entity();
-    add_Rect(square, (Rectangle){100.0f, 100.0f, 20.0f, 20.0f});
-    add_Velocity(square, (Velocity){0});
-    add_Color(square, RED);
-    add_Player(square, (Player){});
+    ECSWorld world = {0};
+    ECSEntity *square = ecs_spawn_entity(&world);
+    add_Rect(&world, square, (Rectangle){100.0f, 100.0f, 20.0f, 20.0f});
+    add_Velocity(&world, square, (Velocity){0});
+    add_Color(&world, square, RED);
+    add_Player(&world, square);
 
     while (!WindowShouldClose()) {
         BeginDrawing();
             ClearBackground(DARKGRAY);
-            keyborad_events_system();
-            move_rects_system();
-            draw_rects_system();
+            keyborad_events_system(&world);
+            move_rects_system(&world);
+            draw_rects_system(&world);
         EndDrawing();
     }
     CloseWindow();
-    ecs_deinit();
+    ecs_deinit(&world);
 }
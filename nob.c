@@ -15,11 +15,34 @@ bool build_game(Cmd* cmd, char *input, char *outupt) {
     return cmd_run_sync_and_reset(cmd);
 }
 
+// Headless, no raylib: `./nob bench` then `./build/bench [max_entities]`
+bool build_bench(Cmd* cmd, char *input, char *output, bool archetypes) {
+    nob_cc(cmd);
+    nob_cc_inputs(cmd, input);
+    nob_cc_output(cmd, output);
+    nob_cc_flags(cmd);
+    cmd_append(cmd, "-O2");
+    if(archetypes) cmd_append(cmd, "-DECS_ARCHETYPES");
+    cmd_append(cmd, "-lpthread");
+    return cmd_run_sync_and_reset(cmd);
+}
+
 int main(int argc, char** argv) {
     NOB_GO_REBUILD_URSELF(argc, argv);
     Cmd cmd = {0};
 
     if(!mkdir_if_not_exists(BUILD_DIR)) return 1;
+    if(argc > 1 && strcmp(argv[1], "bench") == 0) {
+        if(!build_bench(&cmd, SRC_DIR"/bench.c", BUILD_DIR"/bench", false)) return 1;
+        if(!build_bench(&cmd, SRC_DIR"/bench.c", BUILD_DIR"/bench_archetypes", true)) return 1;
+        return 0;
+    }
+    // Headless, `./nob replication` then `./build/replication`
+    if(argc > 1 && strcmp(argv[1], "replication") == 0) {
+        if(!build_bench(&cmd, SRC_DIR"/replication.c", BUILD_DIR"/replication", false)) return 1;
+        if(!build_bench(&cmd, SRC_DIR"/replication.c", BUILD_DIR"/replication_archetypes", true)) return 1;
+        return 0;
+    }
     if(!build_game(&cmd, SRC_DIR"/snake.c", BUILD_DIR"/snake")) return 1;
     if(!build_game(&cmd, SRC_DIR"/with_raylib.c", BUILD_DIR"/with_raylib")) return 1;
 